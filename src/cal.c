@@ -40,6 +40,7 @@
 #endif
 
 #include "cal.h"
+#include "crc32.h"
 
 #define MAX_SIZE	393216
 #define INDEX_LAST	(0xFF + 1)
@@ -164,29 +165,6 @@ void cal_finish(struct cal * cal) {
 
 }
 
-static uint32_t crc32(uint32_t crc, const void * _data, size_t size) {
-
-	const uint8_t * data = _data;
-	uint8_t value;
-	unsigned int bit;
-	size_t i;
-	const uint32_t poly = 0xEDB88320;
-
-	for ( i = 0; i < size; i++ ) {
-		value = data[i];
-		for ( bit = 8; bit; bit-- ) {
-			if ( (crc & 1) != (value & 1) )
-				crc = (crc >> 1) ^ poly;
-			else
-				crc >>= 1;
-			value >>= 1;
-		}
-	}
-
-	return crc;
-
-}
-
 static int is_header(void *data, size_t size) {
 
 	struct header * hdr = data;
@@ -22,58 +22,19 @@
 #include <string.h>
 #include <errno.h>
 
+#include <pthread.h>
+
 #include "global.h"
 #include "cold-flash.h"
+#include "crc32.h"
 #include "image.h"
 #include "usb-device.h"
 #include "printf-utils.h"
 
 #define READ_TIMEOUT		500
 #define WRITE_TIMEOUT		3000
-
-static uint32_t tab[256];
-
-static void crc32_gentab(void) {
-
-	int i, j;
-	uint32_t crc;
-	uint32_t poly = 0xEDB88320L;
-
-	for ( i = 0; i < 256; i++) {
-
-		crc = i;
-
-		for ( j = 8; j > 0; j-- ) {
-
-			if ( crc & 1 )
-				crc = (crc >> 1) ^ poly;
-			else
-				crc >>= 1;
-
-		}
-
-		tab[i] = crc;
-
-	}
-
-}
-
-static uint32_t crc32(unsigned char * bytes, size_t size, uint32_t crc) {
-
-	static int gen = 0;
-	uint32_t i;
-
-	if ( ! gen ) {
-		crc32_gentab();
-		gen = 1;
-	}
-
-	for ( i = 0; i < size; ++i )
-		crc = (crc >> 8) ^ tab[(crc ^ bytes[i]) & 0xff];
-
-	return crc;
-
-}
+#define WRITE_SIZE_MIN		1024
+#define WRITE_SIZE_MAX		0x10000
 
 /* Omap Boot Messages */
 /* See spruf98v.pdf (page 3444): OMAP35x Technical Reference Manual - 25.4.5 Peripheral Booting */
@@ -134,39 +95,92 @@ struct xloader_msg {
 #define XLOADER_MSG_TYPE_PING	0x6301326E
 #define XLOADER_MSG_TYPE_SEND	0x6302326E
 
+/* Image must be loaded by image_load(), crc is counted only once */
 struct xloader_msg xloader_msg_create(uint32_t type, struct image * image) {
 
 	struct xloader_msg msg;
-	uint32_t need, sent;
-	int ret;
-	uint8_t buffer[1024];
 
 	msg.type = type;
 	msg.size = 0;
 	msg.crc1 = 0;
 
 	if ( image ) {
-		msg.size = image->size;
-		image_seek(image, 0);
-		sent = 0;
-		while ( sent < image->size ) {
-			need = image->size - sent;
-			if ( need > sizeof(buffer) )
-				need = sizeof(buffer);
-			ret = image_read(image, buffer, need);
-			if ( ret == 0 )
-				break;
-			msg.crc1 = crc32(buffer, ret, msg.crc1);
-			sent += ret;
+		if ( ! image->crc_valid ) {
+			image->crc = crc32(0, image->data, image->size);
+			image->crc_valid = 1;
 		}
+		msg.size = image->size;
+		msg.crc1 = image->crc;
 	}
 
-	msg.crc2 = crc32((unsigned char *)&msg, 12, 0);
+	msg.crc2 = crc32(0, &msg, 12);
 
 	return msg;
 
 }
 
+/*
+ * Size of one bulk transfer, decreased when device does not accept bigger transfers.
+ * It is kept for next cold flash attempts and shared by devices flashed in parallel.
+ */
+static uint32_t write_size_max = WRITE_SIZE_MAX;
+static pthread_mutex_t write_size_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int send_image(usb_dev_handle * udev, struct image * image, const char * name) {
+
+	struct timespec start, end;
+	uint32_t write_size;
+	uint32_t need, sent;
+	double duration;
+	int ret;
+
+	pthread_mutex_lock(&write_size_mutex);
+	write_size = write_size_max;
+	pthread_mutex_unlock(&write_size_mutex);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	printf_progressbar(0, image->size);
+	sent = 0;
+	while ( sent < image->size ) {
+		need = image->size - sent;
+		if ( need > write_size )
+			need = write_size;
+		/* Timeout is for 1 kB transfer, add time for bigger transfers */
+		ret = usb_bulk_write(udev, USB_WRITE_EP, (char *)image->data + sent, need, WRITE_TIMEOUT + need / 64);
+		if ( ret <= 0 && sent == 0 && write_size > WRITE_SIZE_MIN ) {
+			write_size /= 4;
+			if ( write_size < WRITE_SIZE_MIN )
+				write_size = WRITE_SIZE_MIN;
+			pthread_mutex_lock(&write_size_mutex);
+			if ( write_size_max > write_size )
+				write_size_max = write_size;
+			pthread_mutex_unlock(&write_size_mutex);
+			/* Stalled transfer was rejected before any data were accepted, so it can be sent again with smaller transfers */
+			if ( ret == -EPIPE && usb_clear_halt(udev, USB_WRITE_EP) == 0 ) {
+				VERBOSE("Bulk transfer of %u bytes was rejected, trying %u bytes\n", (unsigned int)need, (unsigned int)write_size);
+				continue;
+			}
+			/* Part of failed or timed out transfer could be received by device, so whole exchange must start again */
+			PRINTF_ERROR("Bulk transfer of %u bytes failed, cold flashing will be restarted with %u bytes transfers", (unsigned int)need, (unsigned int)write_size);
+			return -EAGAIN;
+		}
+		if ( ret <= 0 )
+			PRINTF_ERROR_RETURN(name, -1);
+		sent += ret;
+		printf_progressbar(sent, image->size);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	duration = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+	if ( duration > 0 )
+		printf("Sent %u bytes in %.2f s (%.1f kB/s)\n", (unsigned int)sent, duration, sent / duration / 1024);
+
+	return 0;
+
+}
+
 static int read_asic(usb_dev_handle * udev, uint8_t * asic_buffer, int size, int asic_size) {
 
 	int ret;
@@ -182,10 +196,11 @@ static int read_asic(usb_dev_handle * udev, uint8_t * asic_buffer, int size, int
 
 static int send_2nd(usb_dev_handle * udev, struct image * image) {
 
-	uint8_t buffer[1024];
-	uint32_t need, sent;
 	int ret;
 
+	if ( ! image_load(image) )
+		ERROR_RETURN("2nd X-Loader image is corrupted", -1);
+
 	printf("Sending OMAP peripheral boot message...\n");
 	ret = usb_bulk_write(udev, USB_WRITE_EP, (char *)&omap_peripheral_msg, sizeof(omap_peripheral_msg), WRITE_TIMEOUT);
 	if ( ret != sizeof(omap_peripheral_msg) )
@@ -201,21 +216,9 @@ static int send_2nd(usb_dev_handle * udev, struct image * image) {
 	SLEEP(5000);
 
 	printf("Sending 2nd X-Loader image...\n");
-	printf_progressbar(0, image->size);
-	image_seek(image, 0);
-	sent = 0;
-	while ( sent < image->size ) {
-		need = image->size - sent;
-		if ( need > sizeof(buffer) )
-			need = sizeof(buffer);
-		ret = image_read(image, buffer, need);
-		if ( ret == 0 )
-			break;
-		if ( usb_bulk_write(udev, USB_WRITE_EP, (char *)buffer, ret, WRITE_TIMEOUT) != ret )
-			PRINTF_ERROR_RETURN("Sending 2nd X-Loader image failed", -1);
-		sent += ret;
-		printf_progressbar(sent, image->size);
-	}
+	ret = send_image(udev, image, "Sending 2nd X-Loader image failed");
+	if ( ret != 0 )
+		return ret;
 
 	SLEEP(50000);
 	return 0;
@@ -225,10 +228,12 @@ static int send_2nd(usb_dev_handle * udev, struct image * image) {
 static int send_secondary(usb_dev_handle * udev, struct image * image) {
 
 	struct xloader_msg init_msg;
-	uint8_t buffer[1024];
-	uint32_t need, sent;
+	uint8_t buffer[4];
 	int ret;
 
+	if ( ! image_load(image) )
+		ERROR_RETURN("Secondary image is corrupted", -1);
+
 	init_msg = xloader_msg_create(XLOADER_MSG_TYPE_SEND, image);
 
 	printf("Sending X-Loader init message...\n");
@@ -243,21 +248,9 @@ static int send_secondary(usb_dev_handle * udev, struct image * image) {
 		ERROR_RETURN("No response", -1);
 
 	printf("Sending Secondary image...\n");
-	printf_progressbar(0, image->size);
-	image_seek(image, 0);
-	sent = 0;
-	while ( sent < image->size ) {
-		need = image->size - sent;
-		if ( need > sizeof(buffer) )
-			need = sizeof(buffer);
-		ret = image_read(image, buffer, need);
-		if ( ret == 0 )
-			break;
-		if ( usb_bulk_write(udev, USB_WRITE_EP, (char *)buffer, ret, WRITE_TIMEOUT) != ret )
-			PRINTF_ERROR_RETURN("Sending Secondary image failed", -1);
-		sent += ret;
-		printf_progressbar(sent, image->size);
-	}
+	ret = send_image(udev, image, "Sending Secondary image failed");
+	if ( ret != 0 )
+		return ret;
 
 	printf("Waiting for X-Loader response...\n");
 	SLEEP(5000);
@@ -384,19 +377,27 @@ int init_cold_flash(struct usb_device_info * dev) {
 
 int cold_flash(struct usb_device_info * dev, struct image * x2nd, struct image * secondary) {
 
+	int ret;
+
 	if ( x2nd->type != IMAGE_2ND )
 		ERROR_RETURN("Image type is not 2nd X-Loader", -1);
 
 	if ( secondary->type != IMAGE_SECONDARY )
 		ERROR_RETURN("Image type is not Secondary", -1);
 
-	if ( send_2nd(dev->udev, x2nd) != 0 )
+	ret = send_2nd(dev->udev, x2nd);
+	if ( ret == -EAGAIN )
+		return ret;
+	if ( ret != 0 )
 		ERROR_RETURN("Sending 2nd X-Loader image failed", -1);
 
 	if ( ping_timeout(dev->udev) != 0 )
 		ERROR_RETURN("Sending X-Loader ping message failed", -1);
 
-	if ( send_secondary(dev->udev, secondary) != 0 )
+	ret = send_secondary(dev->udev, secondary);
+	if ( ret == -EAGAIN )
+		return ret;
+	if ( ret != 0 )
 		ERROR_RETURN("Sending Secondary image failed", -1);
 
 	printf("Done\n");
@@ -26,7 +26,7 @@
 /* Initialize Cold Flash mde */
 int init_cold_flash(struct usb_device_info * dev);
 
-/* Flash 2nd and secondary image in Cold Flash mode. After flashing device will boot secondary image */
+/* Flash 2nd and secondary image in Cold Flash mode. After flashing device will boot secondary image. Return -EAGAIN if cold flashing must be started again */
 int cold_flash(struct usb_device_info * dev, struct image * x2nd, struct image * secondary);
 
 /* Leave Cold Flashing mode and continue booting */
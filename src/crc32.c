@@ -0,0 +1,281 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32.h"
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_CRC32_ARM
+#elif defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#include <immintrin.h>
+#define HAVE_CRC32_PCLMUL
+#endif
+
+#define CRC32_POLY 0xEDB88320
+
+static uint32_t tab[8][256];
+static pthread_once_t tab_once = PTHREAD_ONCE_INIT;
+
+static void crc32_gentab(void) {
+
+	int i, j;
+	uint32_t crc;
+
+	for ( i = 0; i < 256; i++ ) {
+
+		crc = i;
+
+		for ( j = 8; j > 0; j-- ) {
+
+			if ( crc & 1 )
+				crc = (crc >> 1) ^ CRC32_POLY;
+			else
+				crc >>= 1;
+
+		}
+
+		tab[0][i] = crc;
+
+	}
+
+	/* Slicing tables: tab[j][i] is crc of byte i followed by j zero bytes */
+	for ( i = 0; i < 256; i++ )
+		for ( j = 1; j < 8; j++ )
+			tab[j][i] = (tab[j-1][i] >> 8) ^ tab[0][tab[j-1][i] & 0xff];
+
+}
+
+/* Slicing-by-8, independent of endianity and alignment */
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char * data, size_t size) {
+
+	pthread_once(&tab_once, crc32_gentab);
+
+	for ( ; size >= 8; size -= 8, data += 8 ) {
+		crc ^= (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+		crc = tab[7][crc & 0xff] ^ tab[6][(crc >> 8) & 0xff] ^ tab[5][(crc >> 16) & 0xff] ^ tab[4][crc >> 24]
+			^ tab[3][data[4]] ^ tab[2][data[5]] ^ tab[1][data[6]] ^ tab[0][data[7]];
+	}
+
+	for ( ; size; --size, ++data )
+		crc = (crc >> 8) ^ tab[0][(crc ^ *data) & 0xff];
+
+	return crc;
+
+}
+
+#ifdef HAVE_CRC32_ARM
+
+static uint32_t crc32_arm(uint32_t crc, const unsigned char * data, size_t size) {
+
+	uint64_t val;
+
+	for ( ; size && ( (uintptr_t)data & 7 ); --size, ++data )
+		crc = __crc32b(crc, *data);
+
+	for ( ; size >= 8; size -= 8, data += 8 ) {
+		memcpy(&val, data, 8);
+		crc = __crc32d(crc, val);
+	}
+
+	for ( ; size; --size, ++data )
+		crc = __crc32b(crc, *data);
+
+	return crc;
+
+}
+
+#endif
+
+#ifdef HAVE_CRC32_PCLMUL
+
+/*
+ * Folding with carry-less multiplication and Barrett reduction, see Intel paper
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ * Constants are for bit reflected polynomial 0x04C11DB7. Size must be
+ * multiple of 16 and at least 64.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char * data, size_t size) {
+
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+
+	data += 64;
+	size -= 64;
+
+	/* Fold 4 blocks in parallel */
+	while ( size >= 64 ) {
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		data += 64;
+		size -= 64;
+
+	}
+
+	/* Fold 4 blocks into one */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Fold remaining single blocks */
+	while ( size >= 16 ) {
+
+		x2 = _mm_loadu_si128((const __m128i *)data);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		data += 16;
+		size -= 16;
+
+	}
+
+	/* Fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+
+}
+
+#endif
+
+uint32_t crc32(uint32_t crc, const void * data, size_t size) {
+
+	const unsigned char * ptr = data;
+
+#ifdef HAVE_CRC32_ARM
+	return crc32_arm(crc, ptr, size);
+#else
+#ifdef HAVE_CRC32_PCLMUL
+	if ( size >= 64 && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1") ) {
+		crc = crc32_pclmul(crc, ptr, size & ~(size_t)15);
+		ptr += size & ~(size_t)15;
+		size &= 15;
+	}
+#endif
+	return crc32_slice8(crc, ptr, size);
+#endif
+
+}
+
+/* Multiply a and b modulo polynomial, both in reflected representation */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+
+	uint32_t m = (uint32_t)1 << 31;
+	uint32_t p = 0;
+
+	while ( 1 ) {
+		if ( a & m ) {
+			p ^= b;
+			if ( ( a & ( m - 1 ) ) == 0 )
+				break;
+		}
+		m >>= 1;
+		b = ( b & 1 ) ? ( b >> 1 ) ^ CRC32_POLY : b >> 1;
+	}
+
+	return p;
+
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+
+	/* x^8 modulo polynomial, shift by one byte */
+	uint32_t sq = (uint32_t)1 << 23;
+	uint32_t x = (uint32_t)1 << 31;
+
+	if ( crc1 == 0 )
+		return crc2;
+
+	/* x = x^(8*len2) modulo polynomial */
+	for ( ; len2; len2 >>= 1 ) {
+		if ( len2 & 1 )
+			x = crc32_multmodp(sq, x);
+		sq = crc32_multmodp(sq, sq);
+	}
+
+	return crc32_multmodp(x, crc1) ^ crc2;
+
+}
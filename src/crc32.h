@@ -0,0 +1,32 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* CRC32 (polynomial 0xEDB88320) without initial and final inversion */
+uint32_t crc32(uint32_t crc, const void * data, size_t size);
+
+/* Return crc32 of A followed by B from crc1 of A and crc2 (counted from 0) of B with length len2 */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+#endif
@@ -40,7 +40,7 @@
 #include "usb-device.h"
 #include "printf-utils.h"
 
-static char global_buf[1UL << 22]; /* 4MB */
+#define DISK_BUF_SIZE (1UL << 22) /* 4MB */
 
 int disk_open_dev(int maj, int min, int partition, int readonly) {
 
@@ -208,6 +208,7 @@ int disk_dump_dev(int fd, const char * file) {
 	size_t need, sent;
 	ssize_t size;
 	struct statvfs buf;
+	char * data;
 
 	printf("Dump block device to file %s...\n", file);
 
@@ -253,10 +254,18 @@ int disk_dump_dev(int fd, const char * file) {
 		return -1;
 	}
 
+	/* Every device dumped in parallel has its own buffer */
+	data = malloc(DISK_BUF_SIZE);
+	if ( ! data ) {
+		ALLOC_ERROR();
+		return -1;
+	}
+
 	fd2 = creat(file, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
 	if ( fd2 < 0 ) {
 		ERROR_INFO("Cannot create file %s", file);
+		free(data);
 		return -1;
 	}
 
@@ -265,14 +274,15 @@ int disk_dump_dev(int fd, const char * file) {
 
 	while ( sent < blksize ) {
 		need = blksize - sent;
-		if ( need > sizeof(global_buf) )
-			need = sizeof(global_buf);
-		size = read(fd, global_buf, need);
+		if ( need > DISK_BUF_SIZE )
+			need = DISK_BUF_SIZE;
+		size = read(fd, data, need);
 		if ( size == 0 )
 			break;
-		if ( write(fd2, global_buf, size) != size ) {
+		if ( write(fd2, data, size) != size ) {
 			PRINTF_ERROR("Dumping image failed");
 			close(fd2);
+			free(data);
 			return -1;
 		}
 		sent += size;
@@ -280,6 +290,7 @@ int disk_dump_dev(int fd, const char * file) {
 	}
 
 	close(fd2);
+	free(data);
 	return 0;
 
 }
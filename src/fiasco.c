@@ -18,9 +18,16 @@
 
 */
 
+/* Enable realpath() for glibc */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -41,6 +48,343 @@
 #define WRITE_OR_FAIL_FREE(file, fd, buf, size, var) do { if ( ! simulate ) { if ( write(fd, buf, size) != (ssize_t)size ) { free(var); FIASCO_WRITE_ERROR(file, fd, "Cannot write %d bytes", size); } } } while (0)
 #define WRITE_OR_FAIL(file, fd, buf, size) WRITE_OR_FAIL_FREE(file, fd, buf, size, NULL)
 
+#define FIASCO_INDEX_MAGIC	"0xFFFF-index"
+#define FIASCO_INDEX_VERSION	1
+
+/* Identity of fiasco file, index is valid only if all fields match */
+struct fiasco_index_key {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtime_nsec;
+};
+
+struct fiasco_index {
+	unsigned char * data;
+	size_t size;
+	size_t alloc;
+	int complete;
+};
+
+static int fiasco_index_put(struct fiasco_index * index, const void * data, size_t size) {
+
+	unsigned char * ptr;
+	size_t alloc;
+
+	if ( index->size + size > index->alloc ) {
+		alloc = index->alloc ? index->alloc : 4096;
+		while ( alloc < index->size + size )
+			alloc *= 2;
+		ptr = realloc(index->data, alloc);
+		if ( ! ptr )
+			ALLOC_ERROR_RETURN(-1);
+		index->data = ptr;
+		index->alloc = alloc;
+	}
+
+	memcpy(index->data + index->size, data, size);
+	index->size += size;
+	return 0;
+
+}
+
+static int fiasco_index_put_string(struct fiasco_index * index, const char * str) {
+
+	uint16_t len = strlen(str);
+
+	if ( fiasco_index_put(index, &len, sizeof(len)) < 0 )
+		return -1;
+
+	return fiasco_index_put(index, str, len);
+
+}
+
+static int fiasco_index_get(const unsigned char ** ptr, const unsigned char * end, void * data, size_t size) {
+
+	if ( (size_t)(end - *ptr) < size )
+		return -1;
+
+	memcpy(data, *ptr, size);
+	*ptr += size;
+	return 0;
+
+}
+
+static int fiasco_index_get_string(const unsigned char ** ptr, const unsigned char * end, char * str, size_t size) {
+
+	uint16_t len;
+
+	if ( fiasco_index_get(ptr, end, &len, sizeof(len)) < 0 || len >= size )
+		return -1;
+
+	if ( fiasco_index_get(ptr, end, str, len) < 0 )
+		return -1;
+
+	str[len] = 0;
+	return 0;
+
+}
+
+/* Index file is $XDG_CACHE_HOME/0xFFFF/<hash of real path>.index */
+static char * fiasco_index_path(const char * path, int create) {
+
+	const char * home;
+	const char * dir;
+	char * name;
+	size_t len;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for ( ; *path; ++path ) {
+		hash ^= (unsigned char)*path;
+		hash *= 0x100000001b3ULL;
+	}
+
+	dir = getenv("XDG_CACHE_HOME");
+	home = getenv("HOME");
+
+	if ( ( ! dir || ! dir[0] ) && ( ! home || ! home[0] ) )
+		return NULL;
+
+	if ( dir && dir[0] )
+		home = NULL;
+	else
+		dir = home;
+
+	len = strlen(dir) + sizeof("/.cache/0xFFFF/") + 16 + sizeof(".index");
+	name = malloc(len);
+	if ( ! name )
+		ALLOC_ERROR_RETURN(NULL);
+
+	if ( home ) {
+		snprintf(name, len, "%s/.cache", dir);
+		if ( create )
+			mkdir(name, 0755);
+		snprintf(name, len, "%s/.cache/0xFFFF", dir);
+	} else {
+		if ( create )
+			mkdir(dir, 0755);
+		snprintf(name, len, "%s/0xFFFF", dir);
+	}
+
+	if ( create )
+		mkdir(name, 0755);
+
+	snprintf(name + strlen(name), len - strlen(name), "/%016llx.index", (unsigned long long int)hash);
+	return name;
+
+}
+
+static int fiasco_index_key_from_fd(int fd, struct fiasco_index_key * key) {
+
+	struct stat st;
+
+	if ( fstat(fd, &st) != 0 )
+		return -1;
+
+	memset(key, 0, sizeof(*key));
+	key->dev = st.st_dev;
+	key->ino = st.st_ino;
+	key->size = st.st_size;
+	key->mtime = st.st_mtim.tv_sec;
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+	return 0;
+
+}
+
+/* Fill fiasco from index, on failure fiasco is left without images */
+static int fiasco_index_load(struct fiasco * fiasco, const char * path) {
+
+	int fd;
+	int ret = -1;
+	char * name;
+	struct stat st;
+	struct fiasco_index_key key;
+	struct fiasco_index_key index_key;
+	unsigned char * data = NULL;
+	const unsigned char * ptr;
+	const unsigned char * end;
+	char magic[sizeof(FIASCO_INDEX_MAGIC)];
+	uint32_t version;
+	uint32_t count;
+	char index_path[PATH_MAX];
+
+	uint64_t offset;
+	uint32_t length;
+	uint16_t hash;
+	uint8_t detected_type;
+	char type[13];
+	char device[17];
+	char hwrevs[1024];
+	char version_str[257];
+	char layout[257];
+	struct image * image;
+
+	if ( fiasco_index_key_from_fd(fiasco->fd, &key) < 0 )
+		return -1;
+
+	name = fiasco_index_path(path, 0);
+	if ( ! name )
+		return -1;
+
+	fd = open(name, O_RDONLY);
+	free(name);
+	if ( fd < 0 )
+		return -1;
+
+	if ( fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > (1 << 24) )
+		goto clean;
+
+	data = malloc(st.st_size);
+	if ( ! data )
+		goto clean;
+
+	if ( read(fd, data, st.st_size) != st.st_size )
+		goto clean;
+
+	ptr = data;
+	end = data + st.st_size;
+
+	if ( fiasco_index_get(&ptr, end, magic, sizeof(magic)) < 0 || memcmp(magic, FIASCO_INDEX_MAGIC, sizeof(magic)) != 0 )
+		goto clean;
+
+	if ( fiasco_index_get(&ptr, end, &version, sizeof(version)) < 0 || version != FIASCO_INDEX_VERSION )
+		goto clean;
+
+	if ( fiasco_index_get(&ptr, end, &index_key, sizeof(index_key)) < 0 || memcmp(&key, &index_key, sizeof(key)) != 0 )
+		goto clean;
+
+	if ( fiasco_index_get_string(&ptr, end, index_path, sizeof(index_path)) < 0 || strcmp(index_path, path) != 0 )
+		goto clean;
+
+	if ( fiasco_index_get_string(&ptr, end, fiasco->name, sizeof(fiasco->name)) < 0 )
+		goto clean;
+
+	if ( fiasco_index_get_string(&ptr, end, fiasco->swver, sizeof(fiasco->swver)) < 0 )
+		goto clean;
+
+	if ( fiasco_index_get(&ptr, end, &count, sizeof(count)) < 0 )
+		goto clean;
+
+	VERBOSE("Using fiasco index with %u images\n", (unsigned int)count);
+
+	while ( count > 0 ) {
+
+		if ( fiasco_index_get(&ptr, end, &offset, sizeof(offset)) < 0 )
+			goto clean;
+		if ( fiasco_index_get(&ptr, end, &length, sizeof(length)) < 0 )
+			goto clean;
+		if ( fiasco_index_get(&ptr, end, &hash, sizeof(hash)) < 0 )
+			goto clean;
+		if ( fiasco_index_get(&ptr, end, &detected_type, sizeof(detected_type)) < 0 || detected_type >= IMAGE_COUNT )
+			goto clean;
+		if ( fiasco_index_get_string(&ptr, end, type, sizeof(type)) < 0 )
+			goto clean;
+		if ( fiasco_index_get_string(&ptr, end, device, sizeof(device)) < 0 )
+			goto clean;
+		if ( fiasco_index_get_string(&ptr, end, hwrevs, sizeof(hwrevs)) < 0 )
+			goto clean;
+		if ( fiasco_index_get_string(&ptr, end, version_str, sizeof(version_str)) < 0 )
+			goto clean;
+		if ( fiasco_index_get_string(&ptr, end, layout, sizeof(layout)) < 0 )
+			goto clean;
+
+		if ( offset + length > key.size )
+			goto clean;
+
+		image = image_alloc_from_shared_fd_verified(fiasco->fd, length, offset, hash, detected_type, type, device, hwrevs, version_str, layout);
+		if ( ! image )
+			goto clean;
+
+		fiasco_add_image(fiasco, image);
+		--count;
+
+	}
+
+	if ( ptr == end )
+		ret = 0;
+
+clean:
+	if ( ret < 0 ) {
+		while ( fiasco->first ) {
+			struct image_list * next = fiasco->first->next;
+			image_list_del(fiasco->first);
+			fiasco->first = next;
+		}
+		memset(fiasco->name, 0, sizeof(fiasco->name));
+		memset(fiasco->swver, 0, sizeof(fiasco->swver));
+	}
+	free(data);
+	close(fd);
+	return ret;
+
+}
+
+static int fiasco_index_save(struct fiasco * fiasco, const char * path, struct fiasco_index * images) {
+
+	int fd;
+	char * name;
+	char * tmp;
+	uint32_t version = FIASCO_INDEX_VERSION;
+	uint32_t count = 0;
+	struct image_list * list;
+	struct fiasco_index_key key;
+	struct fiasco_index index;
+
+	if ( fiasco_index_key_from_fd(fiasco->fd, &key) < 0 )
+		return -1;
+
+	for ( list = fiasco->first; list; list = list->next )
+		++count;
+
+	memset(&index, 0, sizeof(index));
+
+	if ( fiasco_index_put(&index, FIASCO_INDEX_MAGIC, sizeof(FIASCO_INDEX_MAGIC)) < 0
+		|| fiasco_index_put(&index, &version, sizeof(version)) < 0
+		|| fiasco_index_put(&index, &key, sizeof(key)) < 0
+		|| fiasco_index_put_string(&index, path) < 0
+		|| fiasco_index_put_string(&index, fiasco->name) < 0
+		|| fiasco_index_put_string(&index, fiasco->swver) < 0
+		|| fiasco_index_put(&index, &count, sizeof(count)) < 0
+		|| fiasco_index_put(&index, images->data, images->size) < 0 ) {
+		free(index.data);
+		return -1;
+	}
+
+	name = fiasco_index_path(path, 1);
+	if ( ! name ) {
+		free(index.data);
+		return -1;
+	}
+
+	tmp = malloc(strlen(name) + sizeof(".tmp"));
+	if ( ! tmp ) {
+		free(name);
+		free(index.data);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	sprintf(tmp, "%s.tmp", name);
+
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if ( fd < 0 || write(fd, index.data, index.size) != (ssize_t)index.size || close(fd) != 0 || rename(tmp, name) != 0 ) {
+		WARNING("Cannot write fiasco index %s", name);
+		unlink(tmp);
+		free(tmp);
+		free(name);
+		free(index.data);
+		return -1;
+	}
+
+	VERBOSE("Written fiasco index %s\n", name);
+
+	free(tmp);
+	free(name);
+	free(index.data);
+	return 0;
+
+}
+
 struct fiasco * fiasco_alloc_empty(void) {
 
 	struct fiasco * fiasco = calloc(1, sizeof(struct fiasco));
@@ -52,7 +396,7 @@ struct fiasco * fiasco_alloc_empty(void) {
 
 }
 
-struct fiasco * fiasco_alloc_from_file(const char * file) {
+static struct fiasco * fiasco_parse(struct fiasco * fiasco, struct fiasco_index * index) {
 
 	uint8_t byte;
 	uint32_t length;
@@ -72,19 +416,8 @@ struct fiasco * fiasco_alloc_from_file(const char * file) {
 	char hwrev[9];
 	unsigned char buf[512];
 	unsigned char *pbuf;
-
-	struct fiasco * fiasco = fiasco_alloc_empty();
-	if ( ! fiasco )
-		return NULL;
-
-	fiasco->fd = open(file, O_RDONLY);
-	if ( fiasco->fd < 0 ) {
-		ERROR_INFO("Cannot open file");
-		fiasco_free(fiasco);
-		return NULL;
-	}
-
-	fiasco->orig_filename = strdup(file);
+	uint64_t offset64;
+	uint8_t type8;
 
 	READ_OR_FAIL(fiasco, &byte, 1);
 	if ( byte != 0xb4 )
@@ -120,7 +453,11 @@ struct fiasco * fiasco_alloc_from_file(const char * file) {
 	while ( 1 ) {
 
 		/* If end of file, return fiasco image */
-		READ_OR_RETURN(fiasco, buf, 7);
+		if ( read(fiasco->fd, buf, 7) != 7 ) {
+			if ( index )
+				index->complete = 1;
+			return fiasco;
+		}
 
 		/* Header of next image */
 		if ( ! ( buf[0] == 0x54 && buf[2] == 0x2E && buf[3] == 0x19 && buf[4] == 0x01 && buf[5] == 0x01 && buf[6] == 0x00 ) ) {
@@ -139,8 +476,11 @@ struct fiasco * fiasco_alloc_from_file(const char * file) {
 		READ_OR_RETURN(fiasco, type, 12);
 
 		byte = type[0];
-		if ( byte == 0xFF )
+		if ( byte == 0xFF ) {
+			if ( index )
+				index->complete = 1;
 			return fiasco;
+		}
 
 		VERBOSE(" %s\n", type);
 
@@ -233,6 +573,21 @@ struct fiasco * fiasco_alloc_from_file(const char * file) {
 
 		fiasco_add_image(fiasco, image);
 
+		if ( index ) {
+			offset64 = offset;
+			type8 = image->type;
+			if ( fiasco_index_put(index, &offset64, sizeof(offset64)) < 0
+				|| fiasco_index_put(index, &length, sizeof(length)) < 0
+				|| fiasco_index_put(index, &hash, sizeof(hash)) < 0
+				|| fiasco_index_put(index, &type8, sizeof(type8)) < 0
+				|| fiasco_index_put_string(index, type) < 0
+				|| fiasco_index_put_string(index, device) < 0
+				|| fiasco_index_put_string(index, hwrevs) < 0
+				|| fiasco_index_put_string(index, version) < 0
+				|| fiasco_index_put_string(index, layout) < 0 )
+				index = NULL;
+		}
+
 		if ( lseek(fiasco->fd, offset+length, SEEK_SET) == (off_t)-1 )
 			FIASCO_READ_ERROR(fiasco, "Cannot seek to next image in file");
 
@@ -240,6 +595,43 @@ struct fiasco * fiasco_alloc_from_file(const char * file) {
 
 }
 
+struct fiasco * fiasco_alloc_from_file(const char * file) {
+
+	struct fiasco_index index;
+	char path[PATH_MAX];
+
+	struct fiasco * fiasco = fiasco_alloc_empty();
+	if ( ! fiasco )
+		return NULL;
+
+	fiasco->fd = open(file, O_RDONLY);
+	if ( fiasco->fd < 0 ) {
+		ERROR_INFO("Cannot open file");
+		fiasco_free(fiasco);
+		return NULL;
+	}
+
+	fiasco->orig_filename = strdup(file);
+
+	if ( ! indexcache || ! realpath(file, path) )
+		return fiasco_parse(fiasco, NULL);
+
+	if ( indexcache == 1 && fiasco_index_load(fiasco, path) == 0 )
+		return fiasco;
+
+	memset(&index, 0, sizeof(index));
+
+	fiasco = fiasco_parse(fiasco, &index);
+
+	/* Store only complete index with verified hashes */
+	if ( fiasco && index.complete && ! lazyverify && ! noverify )
+		fiasco_index_save(fiasco, path, &index);
+
+	free(index.data);
+	return fiasco;
+
+}
+
 void fiasco_free(struct fiasco * fiasco) {
 
 	struct image_list * list = fiasco->first;
@@ -440,6 +832,13 @@ int fiasco_write_to_file(struct fiasco * fiasco, const char * file) {
 			WRITE_OR_FAIL(file, fd, buf, size);
 		}
 
+		/* Do not leave fiasco file with corrupted image data */
+		if ( image_hash_verify(image) < 0 ) {
+			if ( ! simulate )
+				unlink(file);
+			FIASCO_WRITE_ERROR(file, fd, "Image data are corrupted");
+		}
+
 		image_list = image_list->next;
 
 		if ( image_list )
@@ -544,11 +943,23 @@ int fiasco_unpack(struct fiasco * fiasco, const char * dir) {
 			}
 		}
 
-		free(name);
-
 		if ( ! simulate )
 			close(fd);
 
+		/* Do not leave output files with corrupted image data */
+		if ( image_hash_verify(image) < 0 ) {
+			if ( ! simulate ) {
+				unlink(name);
+				if ( layout_name )
+					unlink(layout_name);
+			}
+			free(name);
+			free(layout_name);
+			return -1;
+		}
+
+		free(name);
+
 		if ( image->layout ) {
 
 			if ( ! simulate ) {
@@ -9,6 +9,11 @@
 
 extern int simulate;
 extern int noverify;
+extern int lazyverify;
+extern int indexcache;
+extern int threads;
+extern int readahead;
+extern int usbfs;
 extern int verbose;
 
 #define VERBOSE(...) do { if ( verbose ) { fprintf(stderr, __VA_ARGS__); } } while (0)
@@ -19,19 +19,27 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "global.h"
 #include "device.h"
 #include "image.h"
 
-#define IMAGE_STORE_CUR(image) do { if ( image->is_shared_fd ) { image->cur = lseek(image->fd, 0, SEEK_CUR) - image->offset; if ( image->cur > image->size ) image->cur = image->size; } } while (0)
-#define IMAGE_RESTORE_CUR(image) do { if ( image->is_shared_fd ) { if ( image->cur <= image->size ) lseek(image->fd, image->offset + image->cur, SEEK_SET); else lseek(image->fd, image->offset + image->size, SEEK_SET); } } while (0)
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#include <immintrin.h>
+#define HAVE_HASH_X86
+#endif
+
+static uint16_t image_scan(struct image * image, enum image_type * detected_type);
+static void image_hash_update(struct image * image, size_t cur, const unsigned char * buf, size_t count);
 
 /* format: type-device:hwrevs_version */
 static void image_missing_values_from_name(struct image * image, const char * name) {
@@ -155,11 +163,17 @@ char * image_name_alloc_from_values(struct image * image) {
 
 }
 
-static int image_append(struct image * image, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout) {
+static int image_append(struct image * image, int detect, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout) {
 
 	enum image_type detected_type;
 
-	image->hash = image_hash_from_data(image);
+	/* One pass over image data for both hash and type detection */
+	if ( ! detect )
+		detected_type = image->type;
+	else if ( image->hash_pending )
+		detected_type = image_type_from_data(image);
+	else
+		image->hash = image_scan(image, &detected_type);
 
 	image->devices = calloc(1, sizeof(struct device_list));
 	if ( ! image->devices ) {
@@ -178,7 +192,6 @@ static int image_append(struct image * image, const char * type, const char * de
 		}
 	}
 
-	detected_type = image_type_from_data(image);
 	image->type = detected_type;
 
 	if ( type && type[0] ) {
@@ -217,6 +230,9 @@ static int image_append(struct image * image, const char * type, const char * de
 static void image_align(struct image * image) {
 
 	size_t align;
+	size_t count;
+	uint16_t word;
+	unsigned char buf[2];
 
 	if ( image->type == IMAGE_MMC )
 		align = 8;
@@ -227,11 +243,75 @@ static void image_align(struct image * image) {
 		return;
 
 	align = ((image->size >> align) + 1) << align;
+	count = align - image->size;
+
+	/* Fold 0xFF padding into hash without rereading whole image */
+	if ( image->size & 1 ) {
+		/* Last odd byte of data was not hashed, it forms word with first padding byte */
+		image_seek(image, image->size - 1);
+		if ( image_read(image, buf, 1) == 1 ) {
+			buf[1] = 0xFF;
+			memcpy(&word, buf, 2);
+			image->hash ^= word;
+		}
+		--count;
+	}
+
+	if ( ( count / 2 ) & 1 )
+		image->hash ^= 0xFFFF;
 
 	image->align = align - image->size;
 	image->size = align;
 
-	image->hash = image_hash_from_data(image);
+}
+
+/* Map image data (without alignment padding) to memory, on failure image_read falls back to pread */
+static void image_map(struct image * image) {
+
+	struct stat st;
+	long page;
+	size_t start;
+
+	if ( image->size == 0 )
+		return;
+
+	/* Accessing mapping behind end of file would raise SIGBUS */
+	if ( fstat(image->fd, &st) != 0 || ! S_ISREG(st.st_mode) || (off_t)(image->offset + image->size) > st.st_size )
+		return;
+
+	page = sysconf(_SC_PAGESIZE);
+	if ( page <= 0 )
+		page = 4096;
+
+	start = image->offset - image->offset % page;
+
+	image->map_offset = image->offset - start;
+	image->map_size = image->map_offset + image->size;
+
+	image->map = mmap(NULL, image->map_size, PROT_READ, MAP_SHARED, image->fd, start);
+	if ( image->map == MAP_FAILED ) {
+		VERBOSE("Cannot mmap image data, using pread\n");
+		image->map = NULL;
+		image->map_size = 0;
+		image->map_offset = 0;
+	} else {
+		posix_madvise(image->map, image->map_size, POSIX_MADV_SEQUENTIAL);
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(image->fd, image->offset, image->size, POSIX_FADV_SEQUENTIAL);
+#endif
+
+}
+
+static void image_unmap(struct image * image) {
+
+	if ( image->map )
+		munmap(image->map, image->map_size);
+
+	image->map = NULL;
+	image->map_size = 0;
+	image->map_offset = 0;
 
 }
 
@@ -283,15 +363,9 @@ struct image * image_alloc_from_fd(int fd, const char * orig_filename, const cha
 	image->cur = 0;
 	image->orig_filename = strdup(orig_filename);
 
-	if ( lseek(image->fd, 0, SEEK_SET) == (off_t)-1 ) {
-		ERROR_INFO("Cannot seek to begin of file %s", orig_filename);
-		close(image->fd);
-		free(image->orig_filename);
-		free(image);
-		return NULL;
-	}
+	image_map(image);
 
-	if ( image_append(image, type, device, hwrevs, version, layout) < 0 )
+	if ( image_append(image, 1, type, device, hwrevs, version, layout) < 0 )
 		return NULL;
 
 	if ( ( ! type || ! type[0] ) && ( ! device || ! device[0] ) && ( ! hwrevs || ! hwrevs[0] ) && ( ! version || ! version[0] ) )
@@ -315,10 +389,18 @@ struct image * image_alloc_from_shared_fd(int fd, size_t size, size_t offset, ui
 	image->offset = offset;
 	image->cur = 0;
 
-	if ( image_append(image, type, device, hwrevs, version, layout) < 0 )
+	image_map(image);
+
+	/* Trust hash from fiasco header, it is verified while image data are read */
+	if ( lazyverify && ! noverify ) {
+		image->hash = hash;
+		image->hash_pending = 1;
+	}
+
+	if ( image_append(image, 1, type, device, hwrevs, version, layout) < 0 )
 		return NULL;
 
-	if ( ! noverify && image->hash != hash ) {
+	if ( ! noverify && ! image->hash_pending && image->hash != hash ) {
 		ERROR("Image hash mishmash (counted %#04x, got %#04x)", image->hash, hash);
 		image_free(image);
 		return NULL;
@@ -330,11 +412,67 @@ struct image * image_alloc_from_shared_fd(int fd, size_t size, size_t offset, ui
 
 }
 
+/* Hash and type of image data are already known (e.g. from fiasco index cache), do not read data */
+struct image * image_alloc_from_shared_fd_verified(int fd, size_t size, size_t offset, uint16_t hash, enum image_type detected_type, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout) {
+
+	struct image * image = image_alloc();
+	if ( ! image )
+		return NULL;
+
+	image->is_shared_fd = 1;
+	image->fd = fd;
+	image->size = size;
+	image->offset = offset;
+	image->cur = 0;
+	image->hash = hash;
+	image->type = detected_type;
+
+	image_map(image);
+
+	if ( image_append(image, 0, type, device, hwrevs, version, layout) < 0 )
+		return NULL;
+
+	image_align(image);
+
+	return image;
+
+}
+
+/* Clone shares fd, mapping, metadata and already loaded data with image, but has its own read position and hash state. Image must outlive its clones */
+struct image * image_alloc_clone(struct image * image) {
+
+	struct image * clone = image_alloc();
+	if ( ! clone )
+		return NULL;
+
+	*clone = *image;
+	clone->is_shared_fd = 1;
+	clone->is_clone = 1;
+	clone->cur = 0;
+	clone->hash_counted = 0;
+	clone->hash_cur = 0;
+	clone->hash_last = 0;
+	clone->is_shared_data = ( image->data != NULL );
+
+	return clone;
+
+}
+
 void image_free(struct image * image) {
 
 	if ( ! image )
 		return;
 
+	if ( image->is_clone ) {
+		if ( ! image->is_shared_data )
+			free(image->data);
+		free(image);
+		return;
+	}
+
+	image_unmap(image);
+	free(image->data);
+
 	if ( ! image->is_shared_fd ) {
 		close(image->fd);
 		image->fd = -1;
@@ -357,79 +495,392 @@ void image_free(struct image * image) {
 
 void image_seek(struct image * image, size_t whence) {
 
-	off_t offset;
-
 	if ( whence > image->size )
 		return;
 
-	if ( whence >= image->size - image->align ) {
-		offset = lseek(image->fd, image->size - image->align - 1, SEEK_SET);
-		image->acur = whence - ( image->size - image->align );
-	} else {
-		offset = lseek(image->fd, image->offset + whence, SEEK_SET);
-		image->acur = 0;
+	image->cur = whence;
+
+}
+
+size_t image_read(struct image * image, void * buf, size_t count) {
+
+	ssize_t ret;
+	size_t end;
+	size_t new_count;
+	size_t ret_count = 0;
+	size_t cur = image->cur;
+
+	/* Image data are followed by align bytes of 0xFF padding */
+	end = image->size - image->align;
+
+	if ( image->cur < end ) {
+
+		new_count = count;
+		if ( new_count > end - image->cur )
+			new_count = end - image->cur;
+
+		if ( image->map ) {
+			memcpy(buf, (unsigned char *)image->map + image->map_offset + image->cur, new_count);
+			ret = new_count;
+		} else {
+			ret = pread(image->fd, buf, new_count, image->offset + image->cur);
+			if ( ret < 0 ) {
+				ERROR_INFO("Cannot read file %s", (image->orig_filename ? image->orig_filename : "(unknown)"));
+				return 0;
+			}
+		}
+
+		image->cur += ret;
+		ret_count += ret;
+
+		if ( (size_t)ret != new_count ) {
+			image_hash_update(image, cur, buf, ret_count);
+			return ret_count;
+		}
+
 	}
 
-	if ( offset == (off_t)-1 )
-		ERROR_INFO("Seek in file %s failed", (image->orig_filename ? image->orig_filename : "(unknown)"));
+	if ( ret_count != count && image->cur < image->size ) {
+
+		new_count = count - ret_count;
+		if ( new_count > image->size - image->cur )
+			new_count = image->size - image->cur;
+
+		memset((unsigned char *)buf + ret_count, 0xFF, new_count);
+		image->cur += new_count;
+		ret_count += new_count;
+
+	}
 
-	IMAGE_STORE_CUR(image);
+	image_hash_update(image, cur, buf, ret_count);
+
+	return ret_count;
 
 }
 
-size_t image_read(struct image * image, void * buf, size_t count) {
+/* Zero copy variant of image_read for mapped images, returns NULL for unmapped image or in alignment padding */
+const void * image_read_map(struct image * image, size_t * count) {
+
+	const void * ptr;
+	size_t end;
+
+	end = image->size - image->align;
 
+	if ( ! image->map || image->cur >= end )
+		return NULL;
+
+	if ( *count > end - image->cur )
+		*count = end - image->cur;
+
+	ptr = (unsigned char *)image->map + image->map_offset + image->cur;
+	image_hash_update(image, image->cur, ptr, *count);
+	image->cur += *count;
+
+	return ptr;
+
+}
+
+/* Load whole image including padding into memory, it stays there until image is freed */
+const unsigned char * image_load(struct image * image) {
+
+	void * data;
 	size_t cur;
-	ssize_t ret;
-	off_t offset;
-	size_t new_count = 0;
-	size_t ret_count = 0;
+	size_t ret;
+	size_t done = 0;
 
-	IMAGE_RESTORE_CUR(image);
+	if ( image->data )
+		return image->data;
 
-	if ( ! image->is_shared_fd || image->cur < image->size - image->align ) {
+	if ( posix_memalign(&data, 64, image->size ? image->size : 1) != 0 )
+		ALLOC_ERROR_RETURN(NULL);
 
-		if ( image->is_shared_fd && image->cur + count > image->size - image->align )
-			new_count = image->size - image->align - image->cur;
-		else
-			new_count = count;
+	cur = image->cur;
+	image_seek(image, 0);
+	while ( done < image->size ) {
+		ret = image_read(image, (unsigned char *)data + done, image->size - done);
+		if ( ret == 0 )
+			break;
+		done += ret;
+	}
+	image_seek(image, cur);
+
+	if ( done != image->size ) {
+		free(data);
+		ERROR_RETURN("Cannot load image data", NULL);
+	}
+
+	if ( image_hash_verify(image) < 0 ) {
+		free(data);
+		return NULL;
+	}
+
+	image->data = data;
+	return image->data;
 
-		ret = read(image->fd, buf, new_count);
-		if ( ret > 0 )
-			ret_count += ret;
+}
+
+struct image_reader {
+	struct image * image;
+	const unsigned char * data;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int threaded;
+	int depth;
+	size_t chunk;
+	unsigned char ** bufs;
+	size_t * counts;
+	int head;
+	int tail;
+	int filled;
+	int consuming;
+	int done;
+	int stop;
+};
 
-		IMAGE_STORE_CUR(image);
+/* Fill free buffers of ring until whole image is read */
+static void * image_reader_run(void * arg) {
 
-		if ( ret < 0 )
-			return 0;
+	struct image_reader * reader = arg;
+	struct image * image = reader->image;
+	size_t need;
+	size_t ret;
+
+	while ( 1 ) {
+
+		pthread_mutex_lock(&reader->mutex);
+		while ( reader->filled == reader->depth && ! reader->stop )
+			pthread_cond_wait(&reader->cond, &reader->mutex);
+		if ( reader->stop ) {
+			pthread_mutex_unlock(&reader->mutex);
+			break;
+		}
+		pthread_mutex_unlock(&reader->mutex);
+
+		need = image->size - image->cur;
+		if ( need > reader->chunk )
+			need = reader->chunk;
+		ret = need ? image_read(image, reader->bufs[reader->head], need) : 0;
+
+		pthread_mutex_lock(&reader->mutex);
+		if ( ret > 0 ) {
+			reader->counts[reader->head] = ret;
+			reader->head = ( reader->head + 1 ) % reader->depth;
+			++reader->filled;
+		}
+		if ( ret == 0 || image->cur >= image->size )
+			reader->done = 1;
+		pthread_cond_signal(&reader->cond);
+		pthread_mutex_unlock(&reader->mutex);
+
+		if ( reader->done )
+			break;
 
 	}
 
-	if ( ret_count == count )
-		return ret_count;
+	return NULL;
 
-	offset = lseek(image->fd, 0, SEEK_CUR);
-	if ( offset == (off_t)-1 ) {
-		ERROR_INFO("Cannot get offset of file %s", (image->orig_filename ? image->orig_filename : "(unknown)"));
-		return 0;
+}
+
+/* Start reading image from beginning into ring of depth buffers with chunk bytes, by separate thread if depth is at least 2 */
+struct image_reader * image_reader_start(struct image * image, size_t chunk, int depth) {
+
+	struct image_reader * reader;
+	void * buf;
+	int i;
+
+	if ( depth < 1 )
+		depth = 1;
+
+	reader = calloc(1, sizeof(struct image_reader));
+	if ( ! reader )
+		ALLOC_ERROR_RETURN(NULL);
+
+	reader->bufs = calloc(depth, sizeof(*reader->bufs));
+	reader->counts = calloc(depth, sizeof(*reader->counts));
+	if ( ! reader->bufs || ! reader->counts ) {
+		image_reader_stop(reader);
+		ALLOC_ERROR_RETURN(NULL);
 	}
 
-	cur = offset - image->offset;
+	reader->image = image;
+	reader->chunk = chunk;
+	reader->depth = depth;
 
-	if ( image->align && cur == image->size - image->align && image->acur < image->align ) {
+	/* Image is already loaded in memory, return pointers to it */
+	if ( image->data ) {
+		reader->data = image->data;
+		image_seek(image, 0);
+		return reader;
+	}
 
-		if ( image->acur + count - ret_count > image->align )
-			new_count = image->align - image->acur;
-		else
-			new_count = count - ret_count;
+	for ( i = 0; i < depth; ++i ) {
+		if ( posix_memalign(&buf, 64, chunk) != 0 ) {
+			image_reader_stop(reader);
+			ALLOC_ERROR_RETURN(NULL);
+		}
+		reader->bufs[i] = buf;
+	}
 
-		memset((unsigned char *)buf+ret_count, 0xFF, new_count);
-		ret_count += new_count;
-		image->acur += new_count;
+	image_seek(image, 0);
 
+	if ( depth < 2 )
+		return reader;
+
+	pthread_mutex_init(&reader->mutex, NULL);
+	pthread_cond_init(&reader->cond, NULL);
+
+	if ( pthread_create(&reader->thread, NULL, image_reader_run, reader) == 0 ) {
+		reader->threaded = 1;
+	} else {
+		pthread_cond_destroy(&reader->cond);
+		pthread_mutex_destroy(&reader->mutex);
 	}
 
-	return ret_count;
+	return reader;
+
+}
+
+/* Return next chunk of image data, previous returned chunk is released. Return NULL at end of image or on error */
+const void * image_reader_next(struct image_reader * reader, size_t * count) {
+
+	const void * ptr = NULL;
+	size_t need;
+
+	*count = 0;
+
+	if ( reader->data ) {
+		need = reader->image->size - reader->image->cur;
+		if ( need > reader->chunk )
+			need = reader->chunk;
+		ptr = reader->data + reader->image->cur;
+		reader->image->cur += need;
+		*count = need;
+		return need ? ptr : NULL;
+	}
+
+	if ( ! reader->threaded ) {
+		need = reader->image->size - reader->image->cur;
+		if ( need > reader->chunk )
+			need = reader->chunk;
+		if ( need > 0 )
+			*count = image_read(reader->image, reader->bufs[0], need);
+		return *count ? reader->bufs[0] : NULL;
+	}
+
+	pthread_mutex_lock(&reader->mutex);
+
+	if ( reader->consuming ) {
+		reader->tail = ( reader->tail + 1 ) % reader->depth;
+		--reader->filled;
+		reader->consuming = 0;
+		pthread_cond_signal(&reader->cond);
+	}
+
+	while ( reader->filled == 0 && ! reader->done )
+		pthread_cond_wait(&reader->cond, &reader->mutex);
+
+	if ( reader->filled > 0 ) {
+		reader->consuming = 1;
+		ptr = reader->bufs[reader->tail];
+		*count = reader->counts[reader->tail];
+	}
+
+	pthread_mutex_unlock(&reader->mutex);
+
+	return ptr;
+
+}
+
+void image_reader_stop(struct image_reader * reader) {
+
+	int i;
+
+	if ( ! reader )
+		return;
+
+	if ( reader->threaded ) {
+		pthread_mutex_lock(&reader->mutex);
+		reader->stop = 1;
+		pthread_cond_signal(&reader->cond);
+		pthread_mutex_unlock(&reader->mutex);
+		pthread_join(reader->thread, NULL);
+		pthread_cond_destroy(&reader->cond);
+		pthread_mutex_destroy(&reader->mutex);
+	}
+
+	if ( reader->bufs )
+		for ( i = 0; i < reader->depth; ++i )
+			free(reader->bufs[i]);
+
+	free(reader->bufs);
+	free(reader->counts);
+	free(reader);
+
+}
+
+/* Images up to this size are loaded into memory by prefetch, bigger are only verified or read ahead by kernel */
+#define IMAGE_PREFETCH_MAX 0x4000000
+
+struct image_prefetch {
+	struct image * image;
+	pthread_t thread;
+	int ret;
+};
+
+static void * image_prefetch_run(void * arg) {
+
+	struct image_prefetch * prefetch = arg;
+	struct image * image = prefetch->image;
+
+	if ( image->size <= IMAGE_PREFETCH_MAX ) {
+		if ( ! image_load(image) )
+			prefetch->ret = -1;
+	} else if ( image->hash_pending ) {
+		prefetch->ret = image_hash_verify(image);
+	} else {
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(image->fd, image->offset, image->size - image->align, POSIX_FADV_WILLNEED);
+#endif
+	}
+
+	return NULL;
+
+}
+
+/* Read and verify image by separate thread, image cannot be used until image_prefetch_finish() is called */
+struct image_prefetch * image_prefetch_start(struct image * image) {
+
+	struct image_prefetch * prefetch;
+
+	prefetch = calloc(1, sizeof(struct image_prefetch));
+	if ( ! prefetch )
+		ALLOC_ERROR_RETURN(NULL);
+
+	prefetch->image = image;
+
+	if ( pthread_create(&prefetch->thread, NULL, image_prefetch_run, prefetch) != 0 ) {
+		free(prefetch);
+		return NULL;
+	}
+
+	return prefetch;
+
+}
+
+/* Wait for prefetch thread, return -1 if image is corrupted */
+int image_prefetch_finish(struct image_prefetch * prefetch) {
+
+	int ret;
+
+	if ( ! prefetch )
+		return 0;
+
+	pthread_join(prefetch->thread, NULL);
+	ret = prefetch->ret;
+	free(prefetch);
+
+	return ret;
 
 }
 
@@ -481,30 +932,6 @@ void image_list_unlink(struct image_list * list) {
 
 }
 
-static uint16_t do_hash(uint16_t * b, size_t len) {
-
-	uint16_t result = 0;
-
-	for ( len >>= 1; len--; b = b+1 )
-		result^=b[0];
-
-	return result;
-
-}
-
-uint16_t image_hash_from_data(struct image * image) {
-
-	unsigned char buf[0x20000];
-	uint16_t hash = 0;
-	size_t ret;
-
-	image_seek(image, 0);
-	while ( ( ret = image_read(image, buf, sizeof(buf)) ) )
-		hash ^= do_hash((uint16_t *)buf, ret);
-
-	return hash;
-}
-
 static const char * image_types[] = {
 	[IMAGE_XLOADER] = "xloader",
 	[IMAGE_2ND] = "2nd",
@@ -518,14 +945,7 @@ static const char * image_types[] = {
 	[IMAGE_CMT_MCUSW] = "cmt-mcusw",
 };
 
-enum image_type image_type_from_data(struct image * image) {
-
-	unsigned char buf[512];
-	size_t size;
-
-	memset(buf, 0, sizeof(buf));
-	image_seek(image, 0);
-	size = image_read(image, buf, sizeof(buf));
+static enum image_type image_type_from_buf(const unsigned char * buf, size_t size, uint32_t image_size) {
 
 	if ( size >= 58 && memcmp(buf+52, "2NDAPE", 6) == 0 )
 		return IMAGE_2ND;
@@ -556,7 +976,7 @@ enum image_type image_type_from_data(struct image * image) {
 	else if ( size >= 4 && memcmp(buf, "\x45\x3d\xcd\x28", 4) == 0 ) /* CRAMFS MAGIC */
 		return IMAGE_INITFS;
 	else if ( size >= 2 && memcmp(buf, "\x85\x19", 2) == 0 ) { /* JFFS2 MAGIC */
-		if ( image->size < 0x1000000 )
+		if ( image_size < 0x1000000 )
 			return IMAGE_INITFS;
 		else
 			return IMAGE_ROOTFS;
@@ -566,6 +986,311 @@ enum image_type image_type_from_data(struct image * image) {
 
 }
 
+enum image_type image_type_from_data(struct image * image) {
+
+	unsigned char buf[512];
+	size_t size;
+
+	memset(buf, 0, sizeof(buf));
+	image_seek(image, 0);
+	size = image_read(image, buf, sizeof(buf));
+
+	return image_type_from_buf(buf, size, image->size);
+
+}
+
+/* Fold 64 bit word to xor of its four 16 bit words, result does not depend on endianity */
+static uint16_t fold_hash64(uint64_t val) {
+
+	val ^= val >> 32;
+	val ^= val >> 16;
+	return val;
+
+}
+
+static uint16_t do_hash_scalar(const uint16_t * b, size_t len) {
+
+	uint16_t result = 0;
+	uint64_t acc = 0;
+	uint64_t val;
+
+	len >>= 1;
+
+	for ( ; len && ( (uintptr_t)b & 7 ); --len, ++b )
+		result ^= b[0];
+
+	for ( ; len >= 4; len -= 4, b += 4 ) {
+		memcpy(&val, b, 8);
+		acc ^= val;
+	}
+
+	for ( ; len; --len, ++b )
+		result ^= b[0];
+
+	return result ^ fold_hash64(acc);
+
+}
+
+#ifdef HAVE_HASH_X86
+
+__attribute__((target("sse2")))
+static uint16_t do_hash_sse2(const uint16_t * b, size_t len) {
+
+	__m128i acc = _mm_setzero_si128();
+	uint64_t val[2];
+	size_t i;
+
+	for ( i = 0; i + 64 <= len; i += 64 ) {
+		acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *)((const char *)b + i)));
+		acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *)((const char *)b + i + 16)));
+		acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *)((const char *)b + i + 32)));
+		acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *)((const char *)b + i + 48)));
+	}
+
+	_mm_storeu_si128((__m128i *)val, acc);
+	return fold_hash64(val[0] ^ val[1]) ^ do_hash_scalar((const uint16_t *)((const char *)b + i), len - i);
+
+}
+
+__attribute__((target("avx2")))
+static uint16_t do_hash_avx2(const uint16_t * b, size_t len) {
+
+	__m256i acc = _mm256_setzero_si256();
+	uint64_t val[4];
+	size_t i;
+
+	for ( i = 0; i + 128 <= len; i += 128 ) {
+		acc = _mm256_xor_si256(acc, _mm256_loadu_si256((const __m256i *)((const char *)b + i)));
+		acc = _mm256_xor_si256(acc, _mm256_loadu_si256((const __m256i *)((const char *)b + i + 32)));
+		acc = _mm256_xor_si256(acc, _mm256_loadu_si256((const __m256i *)((const char *)b + i + 64)));
+		acc = _mm256_xor_si256(acc, _mm256_loadu_si256((const __m256i *)((const char *)b + i + 96)));
+	}
+
+	_mm256_storeu_si256((__m256i *)val, acc);
+	return fold_hash64(val[0] ^ val[1] ^ val[2] ^ val[3]) ^ do_hash_scalar((const uint16_t *)((const char *)b + i), len - i);
+
+}
+
+__attribute__((target("avx512f")))
+static uint16_t do_hash_avx512(const uint16_t * b, size_t len) {
+
+	__m512i acc = _mm512_setzero_si512();
+	uint64_t val[8];
+	size_t i;
+
+	for ( i = 0; i + 256 <= len; i += 256 ) {
+		acc = _mm512_xor_si512(acc, _mm512_loadu_si512((const void *)((const char *)b + i)));
+		acc = _mm512_xor_si512(acc, _mm512_loadu_si512((const void *)((const char *)b + i + 64)));
+		acc = _mm512_xor_si512(acc, _mm512_loadu_si512((const void *)((const char *)b + i + 128)));
+		acc = _mm512_xor_si512(acc, _mm512_loadu_si512((const void *)((const char *)b + i + 192)));
+	}
+
+	_mm512_storeu_si512((void *)val, acc);
+	return fold_hash64(val[0] ^ val[1] ^ val[2] ^ val[3] ^ val[4] ^ val[5] ^ val[6] ^ val[7]) ^ do_hash_scalar((const uint16_t *)((const char *)b + i), len - i);
+
+}
+
+#endif
+
+/* XOR of all 16 bit words in buffer, odd last byte is ignored */
+static uint16_t do_hash(const uint16_t * b, size_t len) {
+
+#ifdef HAVE_HASH_X86
+	if ( len >= 1024 ) {
+		if ( __builtin_cpu_supports("avx512f") )
+			return do_hash_avx512(b, len);
+		if ( __builtin_cpu_supports("avx2") )
+			return do_hash_avx2(b, len);
+		if ( __builtin_cpu_supports("sse2") )
+			return do_hash_sse2(b, len);
+	}
+#endif
+
+	return do_hash_scalar(b, len);
+
+}
+
+/* Minimal size of image data which are hashed by one thread */
+#define HASH_THREAD_MIN 0x400000
+#define HASH_THREAD_MAX 64
+
+struct hash_job {
+	const unsigned char * buf;
+	size_t len;
+	uint16_t hash;
+};
+
+static void * hash_job_run(void * arg) {
+
+	struct hash_job * job = arg;
+
+	job->hash = do_hash((const uint16_t *)job->buf, job->len);
+	return NULL;
+
+}
+
+/* Hash buffer of even length in chunks by multiple threads */
+static uint16_t do_hash_threads(const unsigned char * buf, size_t len) {
+
+	struct hash_job jobs[HASH_THREAD_MAX];
+	pthread_t thread[HASH_THREAD_MAX];
+	int started[HASH_THREAD_MAX];
+	uint16_t hash = 0;
+	size_t chunk;
+	int count;
+	int i;
+
+	count = threads;
+	if ( count > HASH_THREAD_MAX )
+		count = HASH_THREAD_MAX;
+	if ( (size_t)count > len / HASH_THREAD_MIN )
+		count = len / HASH_THREAD_MIN;
+	if ( count < 2 )
+		return do_hash((const uint16_t *)buf, len);
+
+	/* Chunks must start on 16 bit word boundary */
+	chunk = ( len / count + 1 ) & ~(size_t)1;
+
+	for ( i = 0; i < count; ++i ) {
+		jobs[i].buf = buf;
+		jobs[i].len = ( i == count - 1 || len < chunk ) ? len : chunk;
+		buf += jobs[i].len;
+		len -= jobs[i].len;
+		/* First chunk is hashed by current thread */
+		started[i] = ( i > 0 && pthread_create(&thread[i], NULL, hash_job_run, &jobs[i]) == 0 );
+	}
+
+	for ( i = 0; i < count; ++i ) {
+		if ( started[i] )
+			pthread_join(thread[i], NULL);
+		else
+			hash_job_run(&jobs[i]);
+		hash ^= jobs[i].hash;
+	}
+
+	return hash;
+
+}
+
+/* Count hash of whole image and optionally detect its type from first block */
+static uint16_t image_scan(struct image * image, enum image_type * detected_type) {
+
+	unsigned char buf[0x20000];
+	const void * ptr;
+	uint16_t hash = 0;
+	size_t ret;
+	size_t end;
+
+	if ( detected_type )
+		*detected_type = IMAGE_UNKNOWN;
+
+	image_seek(image, 0);
+
+	/* Mapped data of big image are hashed in parallel, odd last byte with padding in loop below */
+	end = image->size - image->align;
+	if ( threads > 1 && image->map && ! image->hash_pending && end >= 2 * HASH_THREAD_MIN ) {
+		ptr = (unsigned char *)image->map + image->map_offset;
+		if ( detected_type ) {
+			*detected_type = image_type_from_buf(ptr, sizeof(buf), image->size);
+			detected_type = NULL;
+		}
+		hash = do_hash_threads(ptr, end & ~(size_t)1);
+		image_seek(image, end & ~(size_t)1);
+	}
+
+	while ( 1 ) {
+		ret = sizeof(buf);
+		ptr = image_read_map(image, &ret);
+		if ( ptr && ( ret & 1 ) && image->cur < image->size ) {
+			/* Last odd byte of data is hashed together with padding */
+			--ret;
+			--image->cur;
+		}
+		if ( ! ptr || ret == 0 ) {
+			ret = image_read(image, buf, sizeof(buf));
+			ptr = buf;
+		}
+		if ( ret == 0 )
+			break;
+		if ( detected_type && image->cur == ret ) {
+			*detected_type = image_type_from_buf(ptr, ret, image->size);
+			detected_type = NULL;
+		}
+		hash ^= do_hash((const uint16_t *)ptr, ret);
+	}
+
+	return hash;
+
+}
+
+uint16_t image_hash_from_data(struct image * image) {
+
+	return image_scan(image, NULL);
+
+}
+
+/* Fold data which are read sequentially into pending hash, already hashed start of data (e.g. read by type detection) is skipped */
+static void image_hash_update(struct image * image, size_t cur, const unsigned char * buf, size_t count) {
+
+	unsigned char word[2];
+	uint16_t val;
+
+	if ( ! image->hash_pending || cur > image->hash_cur || cur + count <= image->hash_cur )
+		return;
+
+	buf += image->hash_cur - cur;
+	count -= image->hash_cur - cur;
+	cur = image->hash_cur;
+
+	image->hash_cur += count;
+
+	if ( cur & 1 ) {
+		word[0] = image->hash_last;
+		word[1] = buf[0];
+		memcpy(&val, word, 2);
+		image->hash_counted ^= val;
+		++buf;
+		--count;
+	}
+
+	if ( ( (uintptr_t)buf & 1 ) == 0 ) {
+		image->hash_counted ^= do_hash((const uint16_t *)buf, count);
+	} else {
+		for ( ; count >= 2; buf += 2, count -= 2 ) {
+			memcpy(&val, buf, 2);
+			image->hash_counted ^= val;
+		}
+	}
+
+	if ( count & 1 )
+		image->hash_last = buf[count-1];
+
+}
+
+/* Verify hash of image with pending hash, data which were not read yet are read now */
+int image_hash_verify(struct image * image) {
+
+	unsigned char buf[0x20000];
+	size_t cur;
+
+	if ( ! image->hash_pending )
+		return 0;
+
+	cur = image->cur;
+	image_seek(image, image->hash_cur);
+	while ( image->hash_cur < image->size && image_read(image, buf, sizeof(buf)) );
+	image_seek(image, cur);
+
+	if ( image->hash_counted != image->hash ) {
+		ERROR("Image hash mishmash (counted %#04x, got %#04x)", image->hash_counted, image->hash);
+		return -1;
+	}
+
+	image->hash_pending = 0;
+	return 0;
+
+}
+
 enum image_type image_type_from_string(const char * type) {
 
 	size_t i;
@@ -50,13 +50,30 @@ struct image {
 
 	int fd;
 	int is_shared_fd;
+	int is_clone;
 	uint32_t align;
 	size_t offset;
 	size_t cur;
-	size_t acur;
 	char * orig_filename;
+
+	void * map;
+	size_t map_size;
+	size_t map_offset;
+
+	int hash_pending;
+	uint16_t hash_counted;
+	size_t hash_cur;
+	unsigned char hash_last;
+
+	unsigned char * data;
+	int is_shared_data;
+	uint32_t crc;
+	int crc_valid;
 };
 
+struct image_reader;
+struct image_prefetch;
+
 struct image_list {
 	struct image * image;
 	struct image_list * prev;
@@ -66,15 +83,25 @@ struct image_list {
 struct image * image_alloc_from_file(const char * file, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout);
 struct image * image_alloc_from_fd(int fd, const char * orig_filename, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout);
 struct image * image_alloc_from_shared_fd(int fd, size_t size, size_t offset, uint16_t hash, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout);
+struct image * image_alloc_from_shared_fd_verified(int fd, size_t size, size_t offset, uint16_t hash, enum image_type detected_type, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout);
+struct image * image_alloc_clone(struct image * image);
 void image_free(struct image * image);
 void image_seek(struct image * image, size_t whence);
 size_t image_read(struct image * image, void * buf, size_t count);
+const void * image_read_map(struct image * image, size_t * count);
+const unsigned char * image_load(struct image * image);
+struct image_reader * image_reader_start(struct image * image, size_t chunk, int depth);
+const void * image_reader_next(struct image_reader * reader, size_t * count);
+void image_reader_stop(struct image_reader * reader);
+struct image_prefetch * image_prefetch_start(struct image * image);
+int image_prefetch_finish(struct image_prefetch * prefetch);
 void image_print_info(struct image * image);
 void image_list_add(struct image_list ** list, struct image * image);
 void image_list_del(struct image_list * list);
 void image_list_unlink(struct image_list * list);
 
 uint16_t image_hash_from_data(struct image * image);
+int image_hash_verify(struct image * image);
 enum image_type image_type_from_data(struct image * image);
 char * image_name_alloc_from_values(struct image * image);
 enum image_type image_type_from_string(const char * type);
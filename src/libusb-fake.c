@@ -0,0 +1,1387 @@
+/*
+    libusb-fake.c - Fake libusb 0.1 library with emulated device for benchmarking 0xFFFF
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* compile: gcc libusb-fake.c -o libusb-fake.so -W -Wall -O2 -fPIC -ldl -shared */
+/* usage: FAKEUSB_MODE=cold LD_PRELOAD=./libusb-fake.so 0xFFFF -M file.fiasco -c -f */
+/* usage: FAKEUSB_BANDWIDTH=30000000 FAKEUSB_LATENCY=125 LD_PRELOAD=./libusb-fake.so 0xFFFF -m rootfs:file -f */
+/* usage: FAKEUSB_MODE=nolo FAKEUSB_REPLAY=file.cap LD_PRELOAD=./libusb-fake.so 0xFFFF -I */
+
+/*
+ * One Nokia N900 (RX-51) is emulated in NOLO, Cold flash (OMAP ROM and X-Loader) or Mk II Update mode.
+ * FAKEUSB_MODE is initial mode: nolo (default), cold or mkii. Device switches mode like real one
+ * when 0xFFFF reboots it and closes USB handle.
+ * FAKEUSB_BANDWIDTH is bandwidth in bytes per second (default: 0 - unlimited) and FAKEUSB_LATENCY
+ * is time of every transfer in us (default: 0). Received images are checked and statistics are
+ * printed to stderr at exit. Device has also emulated usbfs node for asynchronous URBs (option -z).
+ *
+ * FAKEUSB_REPLAY is capture of one connection recorded by libusb-sniff (USBSNIFF_CAPTURE) which is
+ * played back instead of emulation. Every call must match next record, reads return recorded data
+ * and every call takes same time as in capture. At exit time which host spent between calls is
+ * compared with capture, changes above FAKEUSB_REPLAY_THRESHOLD us (default: 100) are printed.
+ * Program fails when replay diverges or when host time is more than FAKEUSB_REPLAY_LIMIT percent
+ * (default: no limit) of capture.
+ */
+
+/* Enable RTLD_NEXT for glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <linux/usbdevice_fs.h>
+
+#include <usb.h>
+
+#include "libusb-sniff.h"
+
+#define FAKE_WRITE_EP		0x01
+#define FAKE_WRITE_DATA_EP	0x02
+#define FAKE_READ_EP		0x81
+
+/* NOLO */
+#define NOLO_WRITE		64
+#define NOLO_QUERY		192
+#define NOLO_STATUS		1
+#define NOLO_GET_NOLO_VERSION	3
+#define NOLO_IDENTIFY		4
+#define NOLO_ERROR_LOG		5
+#define NOLO_GET		17
+#define NOLO_STRING		18
+#define NOLO_GET_STRING		20
+#define NOLO_SEND_IMAGE		66
+#define NOLO_FLASH_IMAGE	80
+#define NOLO_SEND_FLASH_FINISH	82
+#define NOLO_SEND_FLASH_IMAGE	84
+#define NOLO_BOOT		130
+#define NOLO_REBOOT		131
+
+/* Cold flash */
+#define OMAP_PERIPHERAL_MSG	0xF0030002
+#define OMAP_MEMORY_MSG		0
+#define XLOADER_MSG_TYPE_PING	0x6301326E
+#define XLOADER_MSG_TYPE_SEND	0x6302326E
+
+/* Mk II */
+#define MKII_OUT		0x8810001B
+#define MKII_IN			0x8800101B
+#define MKII_RESPONCE		0x20
+#define MKII_QUEUE_MAX		16
+
+/* Replay */
+#define REPLAY_THRESHOLD	100
+#define REPLAY_REPORT_MAX	10
+
+enum fake_mode {
+	FAKE_NOLO = 0,
+	FAKE_COLD,
+	FAKE_MKII,
+	FAKE_COUNT,
+};
+
+enum fake_cold_state {
+	COLD_ASIC = 0,
+	COLD_BOOT,
+	COLD_2ND_SIZE,
+	COLD_2ND,
+	COLD_XLOADER,
+	COLD_SECONDARY,
+	COLD_DONE,
+};
+
+struct usb_dev_handle {
+	struct usb_device * device;
+};
+
+struct fake_message {
+	uint32_t header;
+	uint16_t size;
+	uint16_t zero;
+	uint8_t num;
+	uint8_t type;
+	char data[];
+} __attribute__((__packed__));
+
+/* Image which is being received */
+struct fake_image {
+	int active;
+	uint32_t size;
+	uint32_t received;
+	int check_hash;
+	uint16_t hash;
+	uint16_t counted;
+	int odd;
+	unsigned char last;
+};
+
+struct fake_stats {
+	unsigned long long calls;
+	unsigned long long bytes;
+	unsigned long long images;
+	struct timespec first;
+	struct timespec last;
+};
+
+static const char * const fake_mode_names[FAKE_COUNT] = { "NOLO", "Cold flash", "Mk II" };
+static const uint16_t fake_products[FAKE_COUNT] = { 0x0105, 0x0106, 0x01c8 };
+static const char * const fake_product_strings[FAKE_COUNT] = { "Nokia N900 (Update mode)", "Nokia USB ROM", "Nokia N900 (Update mode)" };
+
+static struct usb_bus fake_bus;
+static struct usb_device fake_device;
+static struct usb_config_descriptor fake_config;
+static struct usb_dev_handle fake_handle;
+static int fake_initialized;
+static int fake_opened;
+static int fake_claimed;
+
+/* Emulated usbfs node, URBs are finished immediately and reaped in order */
+static int usbfs_fd = -1;
+static int usbfs_claimed;
+static struct usbdevfs_urb ** usbfs_done;
+static size_t usbfs_done_count;
+static size_t usbfs_done_alloc;
+
+static enum fake_mode mode;
+static enum fake_mode next_mode;
+static double bandwidth;
+static long latency;
+
+static struct fake_image image;
+static uint32_t chunk_left;
+static char nolo_string[256];
+static enum fake_cold_state cold_state;
+static int cold_replies;
+static char mkii_queue[MKII_QUEUE_MAX][128];
+static int mkii_queue_size[MKII_QUEUE_MAX];
+static int mkii_queue_head;
+static int mkii_queue_count;
+
+static struct fake_stats stats[FAKE_COUNT];
+static unsigned long long errors;
+
+static char * replay_buf;
+static const struct sniff_record ** replay_records;
+static int64_t * replay_host;
+static size_t replay_count;
+static size_t replay_pos;
+static int replay_diverged;
+static unsigned long long replay_payload_diffs;
+static struct timespec replay_last;
+
+static void fake_set_mode(enum fake_mode new_mode) {
+
+	mode = new_mode;
+	next_mode = new_mode;
+	fake_device.descriptor.idProduct = fake_products[mode];
+	memset(&image, 0, sizeof(image));
+	chunk_left = 0;
+	cold_state = COLD_ASIC;
+	cold_replies = 0;
+	mkii_queue_count = 0;
+
+}
+
+/* Load whole capture and index its records */
+static int replay_load(const char * file) {
+
+	const struct sniff_header * header;
+	const struct sniff_record * rec;
+	FILE * in;
+	long size;
+	size_t offset;
+	size_t count;
+
+	in = fopen(file, "rb");
+	if ( ! in || fseek(in, 0, SEEK_END) < 0 || ( size = ftell(in) ) < 0 || fseek(in, 0, SEEK_SET) < 0 ) {
+		fprintf(stderr, "fakeusb: Cannot open capture %s: %s\n", file, strerror(errno));
+		if ( in )
+			fclose(in);
+		return -1;
+	}
+
+	replay_buf = malloc(size);
+	if ( ! replay_buf || fread(replay_buf, size, 1, in) != 1 ) {
+		fprintf(stderr, "fakeusb: Cannot read capture %s\n", file);
+		fclose(in);
+		return -1;
+	}
+
+	fclose(in);
+
+	header = (const struct sniff_header *)replay_buf;
+	if ( (size_t)size < sizeof(*header) || memcmp(header->magic, SNIFF_MAGIC, sizeof(header->magic)) != 0 || header->version != SNIFF_VERSION ) {
+		fprintf(stderr, "fakeusb: File %s is not libusb-sniff capture\n", file);
+		return -1;
+	}
+
+	for ( count = 0, offset = sizeof(*header); offset + sizeof(*rec) <= (size_t)size; ++count ) {
+		rec = (const struct sniff_record *)(replay_buf + offset);
+		if ( rec->size < sizeof(*rec) + rec->payload || offset + rec->size > (size_t)size )
+			break;
+		offset += rec->size;
+	}
+
+	replay_records = calloc(count + 1, sizeof(*replay_records));
+	replay_host = calloc(count + 1, sizeof(*replay_host));
+	if ( ! replay_records || ! replay_host ) {
+		fprintf(stderr, "fakeusb: Cannot allocate memory\n");
+		return -1;
+	}
+
+	for ( replay_count = 0, offset = sizeof(*header); replay_count < count; ++replay_count ) {
+		replay_records[replay_count] = (const struct sniff_record *)(replay_buf + offset);
+		offset += replay_records[replay_count]->size;
+	}
+
+	return 0;
+
+}
+
+static void replay_report(void);
+
+static void replay_describe(const struct sniff_record * rec, char * buf, size_t size) {
+
+	if ( rec->type == SNIFF_CONTROL )
+		snprintf(buf, size, "%s(requesttype=%d, request=%d, value=%d, index=%d, size=%d)", sniff_type_to_string(rec->type), rec->request_type, rec->request, rec->value, rec->index, rec->length);
+	else if ( rec->type == SNIFF_BULK_WRITE || rec->type == SNIFF_BULK_READ )
+		snprintf(buf, size, "%s(ep=%d, size=%d)", sniff_type_to_string(rec->type), rec->ep, rec->length);
+	else
+		snprintf(buf, size, "%s(%d)", sniff_type_to_string(rec->type), rec->value);
+
+}
+
+static int64_t replay_elapsed(const struct timespec * from, const struct timespec * to) {
+
+	return (int64_t)( to->tv_sec - from->tv_sec ) * 1000000000LL + ( to->tv_nsec - from->tv_nsec );
+
+}
+
+/*
+ * Match call with next record of capture, check outgoing data and wait for time which device
+ * needed in capture. Program is terminated when replay diverges, device would not answer anyway.
+ */
+static const struct sniff_record * replay_call(const struct sniff_record * call, const char * data, int size) {
+
+	const struct sniff_record * rec;
+	const struct sniff_record * prev;
+	struct timespec now;
+	struct timespec ts;
+	char expected[128];
+	char got[128];
+	uint32_t len;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if ( replay_pos >= replay_count ) {
+		replay_describe(call, got, sizeof(got));
+		fprintf(stderr, "fakeusb: Replay reached end of capture, got %s\n", got);
+		replay_diverged = 1;
+		replay_report();
+		_exit(1);
+	}
+
+	rec = replay_records[replay_pos];
+
+	if ( rec->type != call->type || rec->ep != call->ep || rec->length != call->length || rec->request_type != call->request_type || rec->request != call->request || rec->value != call->value || rec->index != call->index ) {
+		replay_describe(rec, expected, sizeof(expected));
+		replay_describe(call, got, sizeof(got));
+		fprintf(stderr, "fakeusb: Replay diverged at record %lu: expected %s, got %s\n", (unsigned long)replay_pos, expected, got);
+		replay_diverged = 1;
+		replay_report();
+		_exit(1);
+	}
+
+	if ( data && size > 0 ) {
+		len = rec->payload < (uint32_t)size ? rec->payload : (uint32_t)size;
+		if ( memcmp(rec + 1, data, len) != 0 || ( ( rec->flags & SNIFF_FLAG_HASH ) && sniff_hash(data, size) != rec->hash ) )
+			++replay_payload_diffs;
+	}
+
+	/* Time which host spent after previous call */
+	if ( replay_pos > 0 ) {
+		prev = replay_records[replay_pos - 1];
+		replay_host[replay_pos] = replay_elapsed(&replay_last, &now) - (int64_t)( rec->time - prev->time - prev->duration );
+	}
+
+	ts.tv_sec = rec->duration / 1000000000ULL;
+	ts.tv_nsec = rec->duration % 1000000000ULL;
+	if ( rec->duration >= 1000 )
+		nanosleep(&ts, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &replay_last);
+	++replay_pos;
+
+	return rec;
+
+}
+
+/* Copy recorded incoming data, missing part of truncated payload is zeroed */
+static int replay_read(const struct sniff_record * rec, char * bytes, int size) {
+
+	uint32_t len;
+
+	if ( rec->status <= 0 )
+		return rec->status;
+
+	len = rec->status < size ? (uint32_t)rec->status : (uint32_t)size;
+	if ( len > rec->payload ) {
+		memcpy(bytes, rec + 1, rec->payload);
+		memset(bytes + rec->payload, 0, len - rec->payload);
+	} else {
+		memcpy(bytes, rec + 1, len);
+	}
+
+	return rec->status;
+
+}
+
+static int replay_transfer(enum sniff_type type, int ep, int requesttype, int request, int value, int index, char * bytes, int size) {
+
+	struct sniff_record call;
+	const struct sniff_record * rec;
+	int in;
+
+	memset(&call, 0, sizeof(call));
+	call.type = type;
+	call.ep = ep;
+	call.request_type = requesttype;
+	call.request = request;
+	call.value = value;
+	call.index = index;
+	call.length = size;
+
+	if ( type == SNIFF_CONTROL )
+		in = requesttype & 0x80;
+	else
+		in = ( type == SNIFF_BULK_READ );
+
+	rec = replay_call(&call, in ? NULL : bytes, size);
+
+	if ( in )
+		return replay_read(rec, bytes, size);
+
+	return rec->status;
+
+}
+
+static int replay_compare(const void * a, const void * b) {
+
+	int64_t da = replay_host[*(const size_t *)a];
+	int64_t db = replay_host[*(const size_t *)b];
+
+	if ( da < 0 )
+		da = -da;
+	if ( db < 0 )
+		db = -db;
+
+	return ( da < db ) - ( da > db );
+
+}
+
+static void replay_report(void) {
+
+	const struct sniff_record * rec;
+	const struct sniff_record * prev;
+	size_t * order;
+	size_t i;
+	size_t printed;
+	int64_t captured = 0;
+	int64_t host = 0;
+	long threshold = REPLAY_THRESHOLD;
+	const char * env;
+	char desc[128];
+	int failed = replay_diverged;
+
+	env = getenv("FAKEUSB_REPLAY_THRESHOLD");
+	if ( env )
+		threshold = atol(env);
+
+	for ( i = 1; i < replay_pos; ++i ) {
+		rec = replay_records[i];
+		prev = replay_records[i - 1];
+		captured += rec->time - prev->time - prev->duration;
+		host += rec->time - prev->time - prev->duration + replay_host[i];
+	}
+
+	fprintf(stderr, "fakeusb: Replay: %lu of %lu records, host time %.3f ms, in capture %.3f ms", (unsigned long)replay_pos, (unsigned long)replay_count, host / 1e6, captured / 1e6);
+	if ( captured > 0 )
+		fprintf(stderr, " (%+.1f%%)", ( host - captured ) * 100.0 / captured);
+	fprintf(stderr, "\n");
+
+	if ( replay_payload_diffs )
+		fprintf(stderr, "fakeusb: Replay: %llu outgoing transfers have different data\n", replay_payload_diffs);
+
+	order = calloc(replay_pos + 1, sizeof(*order));
+	if ( order ) {
+
+		for ( i = 0; i < replay_pos; ++i )
+			order[i] = i;
+
+		qsort(order, replay_pos, sizeof(*order), replay_compare);
+
+		for ( printed = 0; printed < replay_pos && printed < REPLAY_REPORT_MAX; ++printed ) {
+			i = order[printed];
+			if ( replay_host[i] / 1000 > threshold || replay_host[i] / 1000 < -threshold ) {
+				rec = replay_records[i];
+				prev = replay_records[i - 1];
+				replay_describe(rec, desc, sizeof(desc));
+				fprintf(stderr, "fakeusb:   record %lu before %s: %.3f ms -> %.3f ms (%+.3f ms)\n", (unsigned long)i, desc, ( rec->time - prev->time - prev->duration ) / 1e6, ( rec->time - prev->time - prev->duration + replay_host[i] ) / 1e6, replay_host[i] / 1e6);
+			} else {
+				break;
+			}
+		}
+
+		free(order);
+
+	}
+
+	env = getenv("FAKEUSB_REPLAY_LIMIT");
+	if ( env && captured > 0 && ( host - captured ) * 100.0 / captured > atof(env) ) {
+		fprintf(stderr, "fakeusb: Replay: host time is over limit %s%%\n", env);
+		failed = 1;
+	}
+
+	if ( failed ) {
+		fprintf(stderr, "fakeusb: Replay FAILED\n");
+		_exit(1);
+	}
+
+}
+
+static void fake_init(void) {
+
+	const char * env;
+
+	if ( fake_initialized )
+		return;
+
+	fake_initialized = 1;
+
+	env = getenv("FAKEUSB_BANDWIDTH");
+	if ( env )
+		bandwidth = atof(env);
+
+	env = getenv("FAKEUSB_LATENCY");
+	if ( env )
+		latency = atol(env);
+
+	strcpy(fake_bus.dirname, "001");
+	fake_bus.devices = &fake_device;
+
+	strcpy(fake_device.filename, "002");
+	fake_device.bus = &fake_bus;
+	fake_device.config = &fake_config;
+	fake_device.descriptor.idVendor = 0x0421;
+	fake_device.descriptor.iManufacturer = 1;
+	fake_device.descriptor.iProduct = 2;
+	fake_device.descriptor.iSerialNumber = 3;
+	fake_device.descriptor.bNumConfigurations = 1;
+	fake_config.iConfiguration = 4;
+
+	env = getenv("FAKEUSB_MODE");
+	if ( env && strcmp(env, "cold") == 0 )
+		fake_set_mode(FAKE_COLD);
+	else if ( env && strcmp(env, "mkii") == 0 )
+		fake_set_mode(FAKE_MKII);
+	else
+		fake_set_mode(FAKE_NOLO);
+
+	env = getenv("FAKEUSB_REPLAY");
+	if ( env && replay_load(env) < 0 )
+		exit(1);
+
+}
+
+/* Account one transfer and wait for time which it takes on emulated bus */
+static void fake_transfer(size_t size) {
+
+	struct timespec ts;
+	double us;
+
+	++stats[mode].calls;
+
+	us = latency;
+	if ( bandwidth > 0 )
+		us += size * 1e6 / bandwidth;
+
+	if ( us < 1 )
+		return;
+
+	ts.tv_sec = us / 1e6;
+	ts.tv_nsec = ( us - ts.tv_sec * 1e6 ) * 1e3;
+	nanosleep(&ts, NULL);
+
+}
+
+static void fake_error(const char * str) {
+
+	fprintf(stderr, "fakeusb: %s\n", str);
+	++errors;
+
+}
+
+/* Parse NOLO and Mk II image header: signature, space, hash, type, size */
+static int fake_image_start(const char * header, size_t size) {
+
+	uint16_t hash;
+	uint32_t len;
+
+	if ( size < 23 || memcmp(header, "\x2E\x19\x01\x01", 4) != 0 ) {
+		fake_error("Invalid image header");
+		return -1;
+	}
+
+	memcpy(&hash, header + 5, 2);
+	memcpy(&len, header + 19, 4);
+
+	memset(&image, 0, sizeof(image));
+	image.active = 1;
+	image.size = ntohl(len);
+	image.check_hash = 1;
+	image.hash = ntohs(hash);
+
+	return 0;
+
+}
+
+static void fake_image_raw(uint32_t size) {
+
+	memset(&image, 0, sizeof(image));
+	image.active = 1;
+	image.size = size;
+
+}
+
+/* Hash is xor of all 16 bit words, last odd byte is not counted */
+static int fake_image_data(const char * data, size_t size) {
+
+	struct timespec now;
+	uint16_t val;
+	unsigned char word[2];
+
+	if ( ! image.active || size > image.size - image.received ) {
+		fake_error("Unexpected image data");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ( stats[mode].bytes == 0 )
+		stats[mode].first = now;
+	stats[mode].last = now;
+	stats[mode].bytes += size;
+
+	image.received += size;
+
+	if ( image.odd && size > 0 ) {
+		word[0] = image.last;
+		word[1] = data[0];
+		memcpy(&val, word, 2);
+		image.counted ^= val;
+		image.odd = 0;
+		++data;
+		--size;
+	}
+
+	for ( ; size >= 2; data += 2, size -= 2 ) {
+		memcpy(&val, data, 2);
+		image.counted ^= val;
+	}
+
+	if ( size ) {
+		image.last = data[0];
+		image.odd = 1;
+	}
+
+	if ( image.received == image.size ) {
+		image.active = 0;
+		++stats[mode].images;
+		if ( image.check_hash && image.counted != image.hash )
+			fake_error("Image hash mishmash");
+	}
+
+	return 0;
+
+}
+
+static int fake_image_complete(void) {
+
+	if ( image.active ) {
+		fake_error("Image was not received completely");
+		return -1;
+	}
+
+	return 0;
+
+}
+
+static int nolo_control(int requesttype, int request, int value, char * bytes, int size) {
+
+	static const char identify[] = "prod_code\0RX-51\0hw_rev\0002101\0";
+	uint32_t version;
+
+	if ( requesttype == NOLO_QUERY ) {
+
+		switch ( request ) {
+		case NOLO_STATUS:
+		case NOLO_GET:
+			memset(bytes, 0, size);
+			return size;
+		case NOLO_GET_NOLO_VERSION:
+			if ( size < 4 )
+				return -EINVAL;
+			version = 1 << 20 | 4 << 16 | 14 << 8;
+			memcpy(bytes, &version, 4);
+			return 4;
+		case NOLO_IDENTIFY:
+			if ( (size_t)size > sizeof(identify) )
+				size = sizeof(identify);
+			memcpy(bytes, identify, size);
+			return size;
+		case NOLO_ERROR_LOG:
+			return 0;
+		case NOLO_GET_STRING:
+			if ( strcmp(nolo_string, "version:sw-release") == 0 && size >= 4 ) {
+				memcpy(bytes, "1.0", 4);
+				return 3;
+			}
+			return 0;
+		}
+
+		return -EPIPE;
+
+	}
+
+	switch ( request ) {
+	case NOLO_STRING:
+		if ( (size_t)size >= sizeof(nolo_string) )
+			return -EINVAL;
+		memcpy(nolo_string, bytes, size);
+		nolo_string[size] = 0;
+		return size;
+	case NOLO_SEND_IMAGE:
+	case NOLO_SEND_FLASH_IMAGE:
+		if ( fake_image_start(bytes, size) < 0 )
+			return -EPIPE;
+		return size;
+	case NOLO_FLASH_IMAGE:
+	case NOLO_SEND_FLASH_FINISH:
+		if ( fake_image_complete() < 0 )
+			return -EPIPE;
+		return 0;
+	case NOLO_BOOT:
+		next_mode = ( value == 1 ) ? FAKE_MKII : FAKE_NOLO;
+		return size;
+	case NOLO_REBOOT:
+		/* Device starts in OMAP ROM after reboot */
+		next_mode = FAKE_COLD;
+		return 0;
+	}
+
+	return size;
+
+}
+
+static int cold_write(const char * bytes, int size) {
+
+	uint32_t val;
+
+	switch ( cold_state ) {
+	case COLD_ASIC:
+	case COLD_BOOT:
+		if ( size != 4 )
+			break;
+		memcpy(&val, bytes, 4);
+		if ( val == OMAP_PERIPHERAL_MSG ) {
+			cold_state = COLD_2ND_SIZE;
+			return size;
+		} else if ( val == OMAP_MEMORY_MSG ) {
+			next_mode = FAKE_NOLO;
+			return size;
+		}
+		break;
+	case COLD_2ND_SIZE:
+		if ( size != 4 )
+			break;
+		memcpy(&val, bytes, 4);
+		fake_image_raw(val);
+		cold_state = COLD_2ND;
+		return size;
+	case COLD_2ND:
+		if ( fake_image_data(bytes, size) < 0 )
+			return -EPIPE;
+		if ( ! image.active )
+			cold_state = COLD_XLOADER;
+		return size;
+	case COLD_XLOADER:
+		if ( size != 16 )
+			break;
+		memcpy(&val, bytes, 4);
+		if ( val == XLOADER_MSG_TYPE_PING ) {
+			++cold_replies;
+			return size;
+		} else if ( val == XLOADER_MSG_TYPE_SEND ) {
+			memcpy(&val, bytes + 4, 4);
+			fake_image_raw(val);
+			++cold_replies;
+			cold_state = COLD_SECONDARY;
+			return size;
+		}
+		break;
+	case COLD_SECONDARY:
+		if ( fake_image_data(bytes, size) < 0 )
+			return -EPIPE;
+		if ( ! image.active ) {
+			++cold_replies;
+			cold_state = COLD_DONE;
+			/* Secondary starts NOLO */
+			next_mode = FAKE_NOLO;
+		}
+		return size;
+	case COLD_DONE:
+		break;
+	}
+
+	fake_error("Unexpected cold flash message");
+	return -EPIPE;
+
+}
+
+static int cold_read(char * bytes, int size) {
+
+	static const unsigned char asic[69] = {
+		0x05,
+		0x01, 0x05, 0x01, 0x34, 0x30, 0x07, 0x03,
+		0x13, 0x02, 0x01, 0x00,
+		0x12, 0x15, 0x01, [35] = 0x14, 0x15, 0x01,
+		[58] = 0x15, 0x09, 0x01,
+	};
+
+	if ( cold_state == COLD_ASIC ) {
+		if ( (size_t)size < sizeof(asic) )
+			return -EINVAL;
+		memcpy(bytes, asic, sizeof(asic));
+		cold_state = COLD_BOOT;
+		return sizeof(asic);
+	}
+
+	if ( cold_replies > 0 && size >= 4 ) {
+		--cold_replies;
+		memset(bytes, 0, 4);
+		return 4;
+	}
+
+	return -ETIMEDOUT;
+
+}
+
+static void mkii_reply(const struct fake_message * msg, const char * data, size_t size) {
+
+	struct fake_message * out;
+	int tail;
+
+	if ( mkii_queue_count == MKII_QUEUE_MAX || sizeof(*out) + size > sizeof(mkii_queue[0]) ) {
+		fake_error("Mk II queue overflow");
+		return;
+	}
+
+	tail = ( mkii_queue_head + mkii_queue_count ) % MKII_QUEUE_MAX;
+	out = (struct fake_message *)mkii_queue[tail];
+	out->header = MKII_IN;
+	out->size = htons(size + 4);
+	out->zero = 0;
+	out->num = msg->num;
+	out->type = msg->type | MKII_RESPONCE;
+	memcpy(out->data, data, size);
+	mkii_queue_size[tail] = sizeof(*out) + size;
+	++mkii_queue_count;
+
+}
+
+static int mkii_write(const char * bytes, int size) {
+
+	const struct fake_message * msg = (const struct fake_message *)bytes;
+	static const char zeros[32];
+	char path[128];
+	size_t len;
+	uint32_t val;
+
+	if ( (size_t)size < sizeof(*msg) || msg->header != MKII_OUT || ntohs(msg->size) != size - sizeof(*msg) + 4 ) {
+		fake_error("Invalid Mk II message");
+		return -EPIPE;
+	}
+
+	len = size - sizeof(*msg);
+
+	switch ( msg->type ) {
+	case 0x00: /* ping */
+		mkii_reply(msg, NULL, 0);
+		break;
+	case 0x01: /* get */
+		if ( len >= sizeof(path) )
+			len = sizeof(path) - 1;
+		memcpy(path, msg->data, len);
+		path[len] = 0;
+		if ( strcmp(path, "/update/protocol_version") == 0 )
+			mkii_reply(msg, "\0" "2", 2);
+		else if ( strcmp(path, "/device/product_code") == 0 )
+			mkii_reply(msg, "\0RX-51", 6);
+		else if ( strcmp(path, "/device/hw_build") == 0 )
+			mkii_reply(msg, "\0" "2101", 5);
+		else if ( strcmp(path, "/update/supported_images") == 0 )
+			mkii_reply(msg, "\0mmc", 4);
+		else if ( strcmp(path, "/version/sw_release") == 0 )
+			mkii_reply(msg, "\0" "1.0", 4);
+		else
+			mkii_reply(msg, "\x01", 1);
+		break;
+	case 0x04: /* image header */
+		if ( fake_image_start(msg->data, len) < 0 )
+			mkii_reply(msg, "\x01", 1);
+		else
+			mkii_reply(msg, zeros, 9);
+		break;
+	case 0x06: /* chunk status */
+		if ( chunk_left )
+			fake_error("Image chunk was not received completely");
+		mkii_reply(msg, zeros, 21);
+		break;
+	case 0x0B: /* chunk query */
+		mkii_reply(msg, zeros, 13);
+		break;
+	case 0x08: /* chunk size */
+		if ( len < 8 ) {
+			mkii_reply(msg, "\x01", 1);
+			break;
+		}
+		memcpy(&val, msg->data + 4, 4);
+		chunk_left = ntohl(val);
+		mkii_reply(msg, zeros, 1);
+		break;
+	case 0x0C: /* reboot */
+		if ( len >= sizeof("reboot=update") - 1 && memcmp(msg->data, "reboot=update", sizeof("reboot=update") - 1) == 0 )
+			next_mode = FAKE_MKII;
+		else
+			next_mode = FAKE_COLD;
+		mkii_reply(msg, zeros, 1);
+		break;
+	default: /* tell, image begin, channel */
+		mkii_reply(msg, zeros, 1);
+		break;
+	}
+
+	return size;
+
+}
+
+static int mkii_read(char * bytes, int size) {
+
+	int len;
+
+	if ( mkii_queue_count == 0 )
+		return -ETIMEDOUT;
+
+	len = mkii_queue_size[mkii_queue_head];
+	if ( len > size )
+		return -EOVERFLOW;
+
+	memcpy(bytes, mkii_queue[mkii_queue_head], len);
+	mkii_queue_head = ( mkii_queue_head + 1 ) % MKII_QUEUE_MAX;
+	--mkii_queue_count;
+
+	return len;
+
+}
+
+static int data_write(const char * bytes, int size) {
+
+	if ( mode == FAKE_MKII ) {
+		if ( (uint32_t)size > chunk_left ) {
+			fake_error("Image data without chunk header");
+			return -EPIPE;
+		}
+		chunk_left -= size;
+	}
+
+	if ( fake_image_data(bytes, size) < 0 )
+		return -EPIPE;
+
+	return size;
+
+}
+
+static double fake_duration(const struct fake_stats * stat) {
+
+	return ( stat->last.tv_sec - stat->first.tv_sec ) + ( stat->last.tv_nsec - stat->first.tv_nsec ) / 1e9;
+
+}
+
+/* Real read and write syscalls of whole process (e.g. reading of images), data read from mapped files are not counted */
+static void fake_print_syscalls(double mb) {
+
+	unsigned long long syscr = 0, syscw = 0;
+	char line[128];
+	FILE * file;
+
+	file = fopen("/proc/self/io", "r");
+	if ( ! file )
+		return;
+
+	while ( fgets(line, sizeof(line), file) ) {
+		sscanf(line, "syscr: %llu", &syscr);
+		sscanf(line, "syscw: %llu", &syscw);
+	}
+
+	fclose(file);
+
+	fprintf(stderr, "fakeusb: %llu read and %llu write syscalls", syscr, syscw);
+	if ( mb > 0 )
+		fprintf(stderr, ", %.1f syscalls/MB", ( syscr + syscw ) / mb);
+	fprintf(stderr, "\n");
+
+}
+
+__attribute__((destructor))
+static void fake_print_stats(void) {
+
+	const struct fake_stats * stat;
+	double duration;
+	double mb;
+	double total = 0;
+	int i;
+
+	if ( ! fake_initialized )
+		return;
+
+	if ( replay_records ) {
+		replay_report();
+		return;
+	}
+
+	for ( i = 0; i < FAKE_COUNT; ++i ) {
+
+		stat = &stats[i];
+		if ( ! stat->calls )
+			continue;
+
+		mb = stat->bytes / 1048576.0;
+		duration = fake_duration(stat);
+
+		fprintf(stderr, "fakeusb: %s: %llu images, %.1f MB", fake_mode_names[i], stat->images, mb);
+		if ( duration > 0 )
+			fprintf(stderr, " in %.3f s, %.1f MB/s", duration, mb / duration);
+		if ( mb > 0 )
+			fprintf(stderr, ", %.1f libusb calls/MB", stat->calls / mb);
+		fprintf(stderr, " (%llu libusb calls)\n", stat->calls);
+
+		total += mb;
+
+	}
+
+	fake_print_syscalls(total);
+
+	fprintf(stderr, "fakeusb: %llu errors\n", errors);
+
+}
+
+/* Emulated device is not in sysfs, so 0xFFFF must find it by libusb */
+DIR * opendir(const char * name) {
+
+	static DIR * (*real_opendir)(const char * name) = NULL;
+
+	if ( strcmp(name, "/sys/bus/usb/devices") == 0 ) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	if ( ! real_opendir )
+		*(void **)(&real_opendir) = dlsym(RTLD_NEXT, "opendir");
+
+	return real_opendir(name);
+
+}
+
+/* usbfs node of emulated device is /dev/null, its ioctls are emulated (not in replay mode, captures contain only libusb calls) */
+int open(const char * name, int flags, ...) {
+
+	static int (*real_open)(const char * name, int flags, ...) = NULL;
+	char path[sizeof(fake_bus.dirname) + sizeof(fake_device.filename) + 16];
+	mode_t mode_arg = 0;
+	va_list ap;
+
+	if ( flags & O_CREAT ) {
+		va_start(ap, flags);
+		mode_arg = va_arg(ap, int);
+		va_end(ap);
+	}
+
+	if ( ! real_open )
+		*(void **)(&real_open) = dlsym(RTLD_NEXT, "open");
+
+	if ( fake_initialized && ! replay_records ) {
+		snprintf(path, sizeof(path), "/dev/bus/usb/%s/%s", fake_bus.dirname, fake_device.filename);
+		if ( strcmp(name, path) == 0 ) {
+			if ( ! fake_opened || usbfs_fd >= 0 ) {
+				errno = ENODEV;
+				return -1;
+			}
+			usbfs_fd = real_open("/dev/null", O_RDWR);
+			usbfs_claimed = 0;
+			usbfs_done_count = 0;
+			return usbfs_fd;
+		}
+	}
+
+	return real_open(name, flags, mode_arg);
+
+}
+
+int close(int fd) {
+
+	static int (*real_close)(int fd) = NULL;
+
+	if ( ! real_close )
+		*(void **)(&real_close) = dlsym(RTLD_NEXT, "close");
+
+	if ( fd >= 0 && fd == usbfs_fd ) {
+		if ( usbfs_done_count > 0 )
+			fake_error("usbfs node closed with unreaped URBs");
+		usbfs_fd = -1;
+		usbfs_claimed = 0;
+	}
+
+	return real_close(fd);
+
+}
+
+static int usbfs_ioctl(unsigned long request, void * arg) {
+
+	struct usbdevfs_urb * urb;
+	int ret;
+
+	if ( request == USBDEVFS_CLAIMINTERFACE ) {
+		if ( fake_claimed ) {
+			fake_error("Interface is already claimed by libusb");
+			errno = EBUSY;
+			return -1;
+		}
+		usbfs_claimed = 1;
+		return 0;
+	} else if ( request == USBDEVFS_RELEASEINTERFACE ) {
+		usbfs_claimed = 0;
+		return 0;
+	} else if ( request == USBDEVFS_SETINTERFACE ) {
+		return 0;
+	} else if ( request == USBDEVFS_SUBMITURB ) {
+		urb = arg;
+		if ( ! usbfs_claimed ) {
+			fake_error("URB submitted without claimed interface");
+			errno = EBUSY;
+			return -1;
+		}
+		if ( urb->type != USBDEVFS_URB_TYPE_BULK ) {
+			errno = EINVAL;
+			return -1;
+		}
+		if ( usbfs_done_count == usbfs_done_alloc ) {
+			usbfs_done_alloc = usbfs_done_alloc ? usbfs_done_alloc * 2 : 64;
+			usbfs_done = realloc(usbfs_done, usbfs_done_alloc * sizeof(*usbfs_done));
+			if ( ! usbfs_done )
+				abort();
+		}
+		ret = usb_bulk_write(&fake_handle, urb->endpoint, urb->buffer, urb->buffer_length, 0);
+		urb->status = ret < 0 ? ret : 0;
+		urb->actual_length = ret < 0 ? 0 : ret;
+		usbfs_done[usbfs_done_count++] = urb;
+		return 0;
+	} else if ( request == USBDEVFS_REAPURB || request == USBDEVFS_REAPURBNDELAY ) {
+		if ( usbfs_done_count == 0 ) {
+			errno = EAGAIN;
+			return -1;
+		}
+		*(struct usbdevfs_urb **)arg = usbfs_done[0];
+		memmove(usbfs_done, usbfs_done + 1, --usbfs_done_count * sizeof(*usbfs_done));
+		return 0;
+	} else if ( request == USBDEVFS_DISCARDURB ) {
+		/* All URBs are already finished */
+		errno = EINVAL;
+		return -1;
+	}
+
+	errno = ENOTTY;
+	return -1;
+
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+
+	static int (*real_ioctl)(int fd, unsigned long request, ...) = NULL;
+	void * arg;
+	va_list ap;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if ( fd >= 0 && fd == usbfs_fd )
+		return usbfs_ioctl(request, arg);
+
+	if ( ! real_ioctl )
+		*(void **)(&real_ioctl) = dlsym(RTLD_NEXT, "ioctl");
+
+	return real_ioctl(fd, request, arg);
+
+}
+
+void usb_init(void) {
+
+	fake_init();
+
+}
+
+int usb_find_busses(void) {
+
+	fake_init();
+	return 1;
+
+}
+
+int usb_find_devices(void) {
+
+	fake_init();
+	return 0;
+
+}
+
+struct usb_bus * usb_get_busses(void) {
+
+	fake_init();
+	return &fake_bus;
+
+}
+
+struct usb_device * usb_device(usb_dev_handle * dev) {
+
+	return dev->device;
+
+}
+
+usb_dev_handle * usb_open(struct usb_device * dev) {
+
+	if ( dev != &fake_device || fake_opened )
+		return NULL;
+
+	/* OMAP ROM sends ASIC ID after every connect */
+	if ( mode == FAKE_COLD )
+		fake_set_mode(FAKE_COLD);
+
+	fake_opened = 1;
+	fake_handle.device = dev;
+
+	return &fake_handle;
+
+}
+
+/* Device reconnects in new mode after it was rebooted */
+int usb_close(usb_dev_handle * dev) {
+
+	fake_opened = 0;
+	fake_claimed = 0;
+	(void)dev;
+
+	if ( next_mode != mode )
+		fake_set_mode(next_mode);
+
+	return 0;
+
+}
+
+int usb_get_string_simple(usb_dev_handle * dev, int index, char * buf, size_t buflen) {
+
+	const char * str = NULL;
+
+	(void)dev;
+
+	if ( index == fake_device.descriptor.iManufacturer )
+		str = "Nokia";
+	else if ( index == fake_device.descriptor.iProduct )
+		str = fake_product_strings[mode];
+	else if ( index == fake_device.descriptor.iSerialNumber )
+		str = "0123456789";
+	else if ( index == fake_config.iConfiguration && mode == FAKE_MKII )
+		str = "Firmware Upgrade Configuration";
+
+	if ( ! str || buflen == 0 )
+		return -EPIPE;
+
+	strncpy(buf, str, buflen - 1);
+	buf[buflen - 1] = 0;
+
+	return strlen(buf);
+
+}
+
+int usb_control_msg(usb_dev_handle * dev, int requesttype, int request, int value, int index, char * bytes, int size, int timeout) {
+
+	(void)dev;
+	(void)timeout;
+
+	if ( replay_records )
+		return replay_transfer(SNIFF_CONTROL, 0, requesttype, request, value, index, bytes, size);
+
+	fake_transfer(size);
+
+	if ( mode != FAKE_NOLO )
+		return -EPIPE;
+
+	return nolo_control(requesttype, request, value, bytes, size);
+
+}
+
+int usb_bulk_write(usb_dev_handle * dev, int ep, const char * bytes, int size, int timeout) {
+
+	(void)dev;
+	(void)timeout;
+
+	if ( replay_records )
+		return replay_transfer(SNIFF_BULK_WRITE, ep, 0, 0, 0, 0, (char *)bytes, size);
+
+	fake_transfer(size);
+
+	if ( mode == FAKE_COLD && ep == FAKE_WRITE_EP )
+		return cold_write(bytes, size);
+	else if ( mode == FAKE_MKII && ep == FAKE_WRITE_EP )
+		return mkii_write(bytes, size);
+	else if ( mode != FAKE_COLD && ep == FAKE_WRITE_DATA_EP )
+		return data_write(bytes, size);
+
+	return -EPIPE;
+
+}
+
+int usb_bulk_read(usb_dev_handle * dev, int ep, char * bytes, int size, int timeout) {
+
+	(void)dev;
+	(void)timeout;
+
+	if ( replay_records )
+		return replay_transfer(SNIFF_BULK_READ, ep, 0, 0, 0, 0, bytes, size);
+
+	fake_transfer(size);
+
+	if ( ep != FAKE_READ_EP )
+		return -EPIPE;
+
+	if ( mode == FAKE_COLD )
+		return cold_read(bytes, size);
+	else if ( mode == FAKE_MKII )
+		return mkii_read(bytes, size);
+
+	return -EPIPE;
+
+}
+
+int usb_set_configuration(usb_dev_handle * dev, int configuration) {
+
+	(void)dev;
+
+	if ( replay_records )
+		return replay_transfer(SNIFF_SET_CONFIGURATION, 0, 0, 0, configuration, 0, NULL, 0);
+
+	return 0;
+
+}
+
+int usb_claim_interface(usb_dev_handle * dev, int interface) {
+
+	(void)dev;
+
+	if ( replay_records )
+		return replay_transfer(SNIFF_CLAIM_INTERFACE, 0, 0, 0, interface, 0, NULL, 0);
+
+	/* Like kernel, interface can be claimed only by one usbfs file */
+	if ( usbfs_claimed ) {
+		fake_error("Interface is already claimed by usbfs node");
+		return -EBUSY;
+	}
+
+	fake_claimed = 1;
+	return 0;
+
+}
+
+int usb_release_interface(usb_dev_handle * dev, int interface) {
+
+	(void)dev;
+	(void)interface;
+	fake_claimed = 0;
+	return 0;
+
+}
+
+int usb_set_altinterface(usb_dev_handle * dev, int alternate) {
+
+	(void)dev;
+
+	if ( replay_records )
+		return replay_transfer(SNIFF_SET_ALTINTERFACE, 0, 0, 0, alternate, 0, NULL, 0);
+
+	return 0;
+
+}
+
+int usb_clear_halt(usb_dev_handle * dev, unsigned int ep) {
+
+	(void)dev;
+	(void)ep;
+	return 0;
+
+}
+
+int usb_reset(usb_dev_handle * dev) {
+
+	(void)dev;
+	return 0;
+
+}
+
+int usb_detach_kernel_driver_np(usb_dev_handle * dev, int interface) {
+
+	(void)dev;
+	(void)interface;
+	return 0;
+
+}
+
+char * usb_strerror(void) {
+
+	static char str[] = "Emulated device error";
+	return str;
+
+}
@@ -0,0 +1,311 @@
+/*
+    libusb-sniff-decode.c - Convert binary captures of libusb-sniff to text or pcap
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* usage: libusb-sniff-decode file.cap > file.txt */
+/* usage: libusb-sniff-decode -p file.cap > file.pcap */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libusb-sniff.h"
+
+/* pcap with Linux usbmon header, readable by wireshark */
+#define PCAP_MAGIC		0xA1B2C3D4
+#define PCAP_LINKTYPE_USB_LINUX	189
+#define PCAP_SNAPLEN		65535
+
+#define USB_TRANSFER_CONTROL	2
+#define USB_TRANSFER_BULK	3
+
+struct pcap_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t network;
+};
+
+struct pcap_record {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct usbmon_packet {
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	char flag_setup;
+	char flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint8_t setup[8];
+};
+
+static char to_ascii(char c) {
+
+	if ( c >= 32 && c <= 126 )
+		return c;
+	return '.';
+
+}
+
+static void dump_bytes(const char * buf, size_t size) {
+
+	size_t i, ascii_cnt = 0;
+	char ascii[17] = { 0, };
+
+	for ( i = 0; i < size; i++ ) {
+		if ( i % 16 == 0 ) {
+			if ( i != 0 ) {
+				printf("  |%s|\n", ascii);
+				ascii[0] = 0;
+				ascii_cnt = 0;
+			}
+			printf("%04X:", (unsigned int)i);
+		}
+		printf(" %02X", buf[i] & 0xFF);
+		ascii[ascii_cnt] = to_ascii(buf[i]);
+		ascii[ascii_cnt + 1] = 0;
+		ascii_cnt++;
+	}
+
+	if ( ascii[0] ) {
+		if ( size % 16 )
+			for ( i = 0; i < 16 - (size % 16); i++ )
+				printf("   ");
+		printf("  |%s|\n", ascii);
+	}
+
+}
+
+static void decode_text(const struct sniff_record * rec, const char * payload) {
+
+	printf("\n==== [%llu.%06llu +%lluus] %s", (unsigned long long)(rec->time / 1000000000ULL), (unsigned long long)(rec->time % 1000000000ULL / 1000), (unsigned long long)(rec->duration / 1000), sniff_type_to_string(rec->type));
+
+	switch ( rec->type ) {
+		case SNIFF_BULK_WRITE:
+		case SNIFF_BULK_READ:
+			printf(" (ep=%d size=%d timeout=%u)", rec->ep, rec->length, rec->timeout);
+			break;
+		case SNIFF_CONTROL:
+			printf("(requesttype=%d, request=%d, value=%d, index=%d, size=%d, timeout=%u)", rec->request_type, rec->request, rec->value, rec->index, rec->length, rec->timeout);
+			break;
+		case SNIFF_SET_CONFIGURATION:
+			printf(" (configuration=%d)", rec->value);
+			break;
+		case SNIFF_CLAIM_INTERFACE:
+			printf(" (interface=%d)", rec->value);
+			break;
+		case SNIFF_SET_ALTINTERFACE:
+			printf(" (alternate=%d)", rec->value);
+			break;
+		default:
+			printf(" (type=%d)", rec->type);
+			break;
+	}
+
+	printf(" ret = %d", rec->status);
+
+	if ( rec->flags & SNIFF_FLAG_HASH )
+		printf(" hash = %08X", rec->hash);
+
+	printf(" ====\n");
+
+	if ( rec->payload ) {
+		dump_bytes(payload, rec->payload);
+		if ( rec->flags & SNIFF_FLAG_TRUNCATED )
+			printf("(truncated)\n");
+		printf("====\n");
+	}
+
+}
+
+static void pcap_packet(const struct sniff_header * header, const struct sniff_record * rec, uint8_t type, uint64_t time, int32_t status, uint32_t length, const char * data, uint32_t size) {
+
+	struct pcap_record pcap;
+	struct usbmon_packet usb;
+	uint64_t nsec = header->start_nsec + time;
+
+	memset(&usb, 0, sizeof(usb));
+	usb.id = rec->time;
+	usb.type = type;
+	usb.xfer_type = ( rec->type == SNIFF_BULK_WRITE || rec->type == SNIFF_BULK_READ ) ? USB_TRANSFER_BULK : USB_TRANSFER_CONTROL;
+	usb.epnum = rec->ep;
+	usb.devnum = 1;
+	usb.busnum = 1;
+	usb.flag_setup = '-';
+	usb.flag_data = size ? 0 : ( type == 'S' ? '>' : '<' );
+	usb.ts_sec = header->start_sec + nsec / 1000000000ULL;
+	usb.ts_usec = nsec % 1000000000ULL / 1000;
+	usb.status = status;
+	usb.length = length;
+	usb.len_cap = size;
+
+	/* Standard requests are stored as control transfers too */
+	if ( usb.xfer_type == USB_TRANSFER_CONTROL && type == 'S' ) {
+		uint8_t request_type = rec->request_type;
+		uint8_t request = rec->request;
+		uint16_t value = rec->value;
+		uint16_t index = rec->index;
+		if ( rec->type == SNIFF_SET_CONFIGURATION ) {
+			request_type = 0x00;
+			request = 9;
+		} else if ( rec->type == SNIFF_SET_ALTINTERFACE ) {
+			request_type = 0x01;
+			request = 11;
+		}
+		usb.flag_setup = 0;
+		usb.setup[0] = request_type;
+		usb.setup[1] = request;
+		usb.setup[2] = value & 0xFF;
+		usb.setup[3] = value >> 8;
+		usb.setup[4] = index & 0xFF;
+		usb.setup[5] = index >> 8;
+		usb.setup[6] = rec->length & 0xFF;
+		usb.setup[7] = ( rec->length >> 8 ) & 0xFF;
+		if ( request_type & 0x80 )
+			usb.epnum |= 0x80;
+	} else if ( usb.xfer_type == USB_TRANSFER_CONTROL && ( rec->request_type & 0x80 ) ) {
+		usb.epnum |= 0x80;
+	}
+
+	pcap.ts_sec = usb.ts_sec;
+	pcap.ts_usec = usb.ts_usec;
+	pcap.incl_len = sizeof(usb) + size;
+	pcap.orig_len = sizeof(usb) + length;
+
+	fwrite(&pcap, sizeof(pcap), 1, stdout);
+	fwrite(&usb, sizeof(usb), 1, stdout);
+	if ( size )
+		fwrite(data, size, 1, stdout);
+
+}
+
+/* Every record is submission with outgoing data and completion with incoming data */
+static void decode_pcap(const struct sniff_header * header, const struct sniff_record * rec, const char * payload) {
+
+	int in;
+	uint32_t done;
+
+	if ( rec->type == SNIFF_CLAIM_INTERFACE )
+		return;
+
+	if ( rec->type == SNIFF_CONTROL )
+		in = rec->request_type & 0x80;
+	else
+		in = ( rec->type == SNIFF_BULK_READ );
+
+	done = rec->status > 0 ? rec->status : 0;
+
+	pcap_packet(header, rec, 'S', rec->time, -EINPROGRESS, in ? 0 : rec->length, in ? NULL : payload, in ? 0 : rec->payload);
+	pcap_packet(header, rec, 'C', rec->time + rec->duration, rec->status < 0 ? rec->status : 0, in ? done : 0, in ? payload : NULL, in ? rec->payload : 0);
+
+}
+
+int main(int argc, char **argv) {
+
+	struct sniff_header header;
+	struct sniff_record rec;
+	struct pcap_header pcap;
+	const char * file;
+	char * payload;
+	FILE * in;
+	int pcap_output = 0;
+	unsigned long long count = 0;
+
+	if ( argc == 3 && strcmp(argv[1], "-p") == 0 ) {
+		pcap_output = 1;
+		file = argv[2];
+	} else if ( argc == 2 ) {
+		file = argv[1];
+	} else {
+		fprintf(stderr, "Usage: %s [-p] capture\n", argv[0]);
+		return 1;
+	}
+
+	in = fopen(file, "rb");
+	if ( ! in ) {
+		fprintf(stderr, "Cannot open %s: %s\n", file, strerror(errno));
+		return 1;
+	}
+
+	if ( fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, SNIFF_MAGIC, sizeof(header.magic)) != 0 || header.version != SNIFF_VERSION ) {
+		fprintf(stderr, "File %s is not libusb-sniff capture\n", file);
+		fclose(in);
+		return 1;
+	}
+
+	payload = malloc(header.payload_max + SNIFF_RECORD_ALIGN);
+	if ( ! payload ) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		fclose(in);
+		return 1;
+	}
+
+	if ( pcap_output ) {
+		memset(&pcap, 0, sizeof(pcap));
+		pcap.magic = PCAP_MAGIC;
+		pcap.version_major = 2;
+		pcap.version_minor = 4;
+		pcap.snaplen = PCAP_SNAPLEN;
+		pcap.network = PCAP_LINKTYPE_USB_LINUX;
+		fwrite(&pcap, sizeof(pcap), 1, stdout);
+	}
+
+	while ( fread(&rec, sizeof(rec), 1, in) == 1 ) {
+
+		if ( rec.size < sizeof(rec) + rec.payload || rec.payload > header.payload_max || rec.size - sizeof(rec) > header.payload_max + SNIFF_RECORD_ALIGN ) {
+			fprintf(stderr, "Corrupted record %llu\n", count);
+			break;
+		}
+
+		if ( fread(payload, rec.size - sizeof(rec), 1, in) != 1 && rec.size != sizeof(rec) ) {
+			fprintf(stderr, "Truncated record %llu\n", count);
+			break;
+		}
+
+		if ( pcap_output )
+			decode_pcap(&header, &rec, payload);
+		else
+			decode_text(&rec, payload);
+
+		++count;
+
+	}
+
+	free(payload);
+	fclose(in);
+
+	fprintf(stderr, "%llu records\n", count);
+	return 0;
+
+}
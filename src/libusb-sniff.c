@@ -17,9 +17,18 @@
 
 */
 
-/* compile: gcc libusb-sniff.c -o libusb-sniff.so -W -Wall -O2 -fPIC -ldl -shared -m32 */
+/* compile: gcc libusb-sniff.c -o libusb-sniff.so -W -Wall -O2 -fPIC -ldl -lpthread -shared -m32 */
 /* usage: sudo USBSNIFF_WAIT=1 LD_PRELOAD=./libusb-sniff.so flasher-3.5 ... */
 /* usage: sudo USBSNIFF_SKIP_READ=1 USBSNIFF_SKIP_WRITE=1 LD_PRELOAD=./libusb-sniff.so flasher-3.5 ... */
+/* usage: sudo USBSNIFF_CAPTURE=file.cap USBSNIFF_PAYLOAD=64 LD_PRELOAD=./libusb-sniff.so flasher-3.5 ... */
+
+/*
+ * With USBSNIFF_CAPTURE binary records (see libusb-sniff.h) are written to file instead of text dumps,
+ * use libusb-sniff-decode for converting them to text or pcap. USBSNIFF_PAYLOAD is maximal number of
+ * stored payload bytes of every transfer (default: 512), USBSNIFF_HASH=1 stores hash of whole transfer
+ * and USBSNIFF_RING is size of memory buffer in MB (default: 16). Records are put to buffer without
+ * locking and written to file by background thread, when buffer is full records are dropped.
+ */
 
 /* Enable RTLD_NEXT for glibc */
 #ifndef _GNU_SOURCE
@@ -29,13 +38,48 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <dlfcn.h>
 
+#include "libusb-sniff.h"
+
+#define CAPTURE_PAYLOAD_DEFAULT	512
+#define CAPTURE_RING_DEFAULT	16
+#define CAPTURE_FLUSH_INTERVAL	10
+
 struct usb_dev_handle;
 struct libusb_device_handle;
 typedef struct usb_dev_handle usb_dev_handle;
 typedef struct libusb_device_handle libusb_device_handle;
 
+/* Environment is parsed only once when library is loaded */
+static int wait_enter;
+static int skip_read;
+static int skip_write;
+static int skip_control;
+
+static int capture_fd = -1;
+static uint32_t capture_payload_max = CAPTURE_PAYLOAD_DEFAULT;
+static int capture_hash;
+static struct timespec capture_start;
+
+/*
+ * Writers reserve space in ring by moving head and publish record by storing its size as last step.
+ * Flush thread writes published records to file, clears them and moves tail.
+ */
+static unsigned char * ring;
+static uint64_t ring_size;
+static uint64_t ring_head;
+static uint64_t ring_tail;
+static unsigned long long ring_dropped;
+static int ring_stop;
+static pthread_t ring_thread;
+
 static char to_ascii(char c) {
 
 	if ( c >= 32 && c <= 126 )
@@ -73,20 +117,268 @@ static void dump_bytes(const char * buf, size_t size) {
 
 }
 
+static uint64_t capture_time(void) {
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - capture_start.tv_sec) * 1000000000ULL + now.tv_nsec - capture_start.tv_nsec;
+
+}
+
+static void ring_copy(uint64_t pos, const void * data, size_t size) {
+
+	size_t offset = pos & ( ring_size - 1 );
+	size_t part = ring_size - offset;
+
+	if ( part > size )
+		part = size;
+
+	memcpy(ring + offset, data, part);
+	memcpy(ring, (const char *)data + part, size - part);
+
+}
+
+static void capture_begin(struct sniff_record * rec, enum sniff_type type, int ep, int length, int timeout) {
+
+	memset(rec, 0, sizeof(*rec));
+	rec->type = type;
+	rec->ep = ep;
+	rec->length = length;
+	rec->timeout = timeout;
+	rec->time = capture_time();
+
+}
+
+static void capture_end(struct sniff_record * rec, int status, const void * data, int size) {
+
+	uint64_t head;
+	uint64_t tail;
+	uint32_t record_size;
+	uint32_t payload;
+
+	rec->duration = capture_time() - rec->time;
+	rec->status = status;
+
+	if ( size < 0 || ! data )
+		size = 0;
+
+	if ( capture_hash && size > 0 ) {
+		rec->hash = sniff_hash(data, size);
+		rec->flags |= SNIFF_FLAG_HASH;
+	}
+
+	payload = size;
+	if ( payload > capture_payload_max ) {
+		payload = capture_payload_max;
+		rec->flags |= SNIFF_FLAG_TRUNCATED;
+	}
+
+	rec->payload = payload;
+	record_size = ( sizeof(*rec) + payload + SNIFF_RECORD_ALIGN - 1 ) & ~(uint32_t)( SNIFF_RECORD_ALIGN - 1 );
+
+	head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+
+	do {
+		tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+		if ( head + record_size - tail > ring_size ) {
+			__atomic_add_fetch(&ring_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	} while ( ! __atomic_compare_exchange_n(&ring_head, &head, head + record_size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) );
+
+	/* Size is first member, it is stored after whole record is in ring */
+	ring_copy(head + sizeof(rec->size), (const char *)rec + sizeof(rec->size), sizeof(*rec) - sizeof(rec->size));
+	if ( payload )
+		ring_copy(head + sizeof(*rec), data, payload);
+
+	__atomic_store_n((uint32_t *)(ring + ( head & ( ring_size - 1 ) )), record_size, __ATOMIC_RELEASE);
+
+}
+
+static int capture_write(const void * data, size_t size) {
+
+	const char * ptr = data;
+	ssize_t ret;
+
+	while ( size > 0 ) {
+		ret = write(capture_fd, ptr, size);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			return -1;
+		ptr += ret;
+		size -= ret;
+	}
+
+	return 0;
+
+}
+
+/* Write all published records from tail, return 0 if there was nothing to write */
+static int capture_flush(void) {
+
+	uint64_t start = ring_tail;
+	uint64_t tail = start;
+	uint32_t size;
+	size_t offset;
+	size_t part;
+
+	while ( tail - start < ring_size ) {
+		size = __atomic_load_n((uint32_t *)(ring + ( tail & ( ring_size - 1 ) )), __ATOMIC_ACQUIRE);
+		if ( ! size )
+			break;
+		tail += size;
+	}
+
+	if ( tail == start )
+		return 0;
+
+	offset = start & ( ring_size - 1 );
+	part = ring_size - offset;
+	if ( part > tail - start )
+		part = tail - start;
+
+	if ( capture_write(ring + offset, part) < 0 || capture_write(ring, tail - start - part) < 0 )
+		fprintf(stderr, "libusb-sniff: Cannot write capture: %s\n", strerror(errno));
+
+	memset(ring + offset, 0, part);
+	memset(ring, 0, tail - start - part);
+
+	__atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+	return 1;
+
+}
+
+static void * capture_thread(void * arg) {
+
+	struct timespec ts = { 0, CAPTURE_FLUSH_INTERVAL * 1000000L };
+
+	(void)arg;
+
+	while ( ! __atomic_load_n(&ring_stop, __ATOMIC_ACQUIRE) )
+		if ( ! capture_flush() )
+			nanosleep(&ts, NULL);
+
+	while ( capture_flush() )
+		;
+
+	return NULL;
+
+}
+
+static void capture_open(const char * file) {
+
+	struct sniff_header header;
+	struct timespec now;
+	const char * env;
+	long ring_mb = CAPTURE_RING_DEFAULT;
+
+	env = getenv("USBSNIFF_PAYLOAD");
+	if ( env )
+		capture_payload_max = atol(env) < 0 ? 0 : atol(env);
+
+	capture_hash = getenv("USBSNIFF_HASH") != NULL;
+
+	env = getenv("USBSNIFF_RING");
+	if ( env && atol(env) > 0 )
+		ring_mb = atol(env);
+
+	for ( ring_size = 1048576; ring_size < (uint64_t)ring_mb * 1048576; ring_size *= 2 )
+		;
+
+	/* Every record must fit into ring */
+	if ( capture_payload_max > ring_size / 4 )
+		capture_payload_max = ring_size / 4;
+
+	ring = calloc(1, ring_size);
+	if ( ! ring ) {
+		fprintf(stderr, "libusb-sniff: Cannot allocate capture buffer\n");
+		return;
+	}
+
+	capture_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ( capture_fd < 0 ) {
+		fprintf(stderr, "libusb-sniff: Cannot open %s: %s\n", file, strerror(errno));
+		free(ring);
+		ring = NULL;
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	clock_gettime(CLOCK_MONOTONIC, &capture_start);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNIFF_MAGIC, sizeof(header.magic));
+	header.version = SNIFF_VERSION;
+	header.payload_max = capture_payload_max;
+	header.start_sec = now.tv_sec;
+	header.start_nsec = now.tv_nsec;
+
+	if ( capture_write(&header, sizeof(header)) < 0 || pthread_create(&ring_thread, NULL, capture_thread, NULL) != 0 ) {
+		fprintf(stderr, "libusb-sniff: Cannot start capture\n");
+		close(capture_fd);
+		capture_fd = -1;
+		free(ring);
+		ring = NULL;
+	}
+
+}
+
+__attribute__((constructor))
+static void sniff_init(void) {
+
+	const char * env;
+
+	wait_enter = getenv("USBSNIFF_WAIT") != NULL;
+	skip_read = getenv("USBSNIFF_SKIP_READ") != NULL;
+	skip_write = getenv("USBSNIFF_SKIP_WRITE") != NULL;
+	skip_control = getenv("USBSNIFF_SKIP_CONTROL") != NULL;
+
+	env = getenv("USBSNIFF_CAPTURE");
+	if ( env )
+		capture_open(env);
+
+}
+
+__attribute__((destructor))
+static void sniff_exit(void) {
+
+	if ( capture_fd < 0 )
+		return;
+
+	__atomic_store_n(&ring_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(ring_thread, NULL);
+	close(capture_fd);
+
+	if ( ring_dropped )
+		fprintf(stderr, "libusb-sniff: %llu records were dropped, capture buffer is too small\n", ring_dropped);
+
+}
+
 int usb_bulk_write(usb_dev_handle * dev, int ep, const char * bytes, int size, int timeout) {
 
 	static int (*real_usb_bulk_write)(usb_dev_handle * dev, int ep, const char * bytes, int size, int timeout) = NULL;
+	struct sniff_record rec;
+	int ret;
 
 	if ( ! real_usb_bulk_write )
 		*(void **)(&real_usb_bulk_write) = dlsym(RTLD_NEXT, "usb_bulk_write");
 
-	if ( ! getenv("USBSNIFF_SKIP_WRITE") ) {
+	if ( capture_fd >= 0 && ! skip_write ) {
+		capture_begin(&rec, SNIFF_BULK_WRITE, ep, size, timeout);
+		ret = real_usb_bulk_write(dev, ep, bytes, size, timeout);
+		capture_end(&rec, ret, bytes, size);
+		return ret;
+	}
+
+	if ( ! skip_write ) {
 
 		printf("\n==== usb_bulk_write (ep=%d size=%d timeout=%d) ====\n", ep, size, timeout);
 		dump_bytes(bytes, size);
 		printf("====\n");
 
-		if ( getenv("USBSNIFF_WAIT") ) {
+		if ( wait_enter ) {
 			printf("Press ENTER"); fflush(stdout); getchar();
 		}
 
@@ -99,14 +391,22 @@ int usb_bulk_write(usb_dev_handle * dev, int ep, const char * bytes, int size, i
 int usb_bulk_read(usb_dev_handle * dev, int ep, char * bytes, int size, int timeout) {
 
 	static int (*real_usb_bulk_read)(usb_dev_handle * dev, int ep, char * bytes, int size, int timeout) = NULL;
+	struct sniff_record rec;
 	int ret;
 
 	if ( ! real_usb_bulk_read )
 		*(void **)(&real_usb_bulk_read) = dlsym(RTLD_NEXT, "usb_bulk_read");
 
+	if ( capture_fd >= 0 && ! skip_read ) {
+		capture_begin(&rec, SNIFF_BULK_READ, ep, size, timeout);
+		ret = real_usb_bulk_read(dev, ep, bytes, size, timeout);
+		capture_end(&rec, ret, bytes, ret);
+		return ret;
+	}
+
 	ret = real_usb_bulk_read(dev, ep, bytes, size, timeout);
 
-	if ( ! getenv("USBSNIFF_SKIP_READ") ) {
+	if ( ! skip_read ) {
 
 		printf("\n==== usb_bulk_read (ep=%d size=%d timeout=%d) ret = %d ====\n", ep, size, timeout, ret);
 		if ( ret > 0 ) {
@@ -114,7 +414,7 @@ int usb_bulk_read(usb_dev_handle * dev, int ep, char * bytes, int size, int time
 			printf("====\n");
 		}
 
-		if ( getenv("USBSNIFF_WAIT") ) {
+		if ( wait_enter ) {
 			printf("Press ENTER"); fflush(stdout); getchar();
 		}
 
@@ -127,16 +427,29 @@ int usb_bulk_read(usb_dev_handle * dev, int ep, char * bytes, int size, int time
 int libusb_bulk_transfer(libusb_device_handle *dev, unsigned char ep, unsigned char *bytes, int size, int *actual_length, unsigned int timeout) {
 
 	static int (*real_libusb_bulk_transfer)(libusb_device_handle *dev, unsigned char ep, unsigned char *bytes, int size, int *actual_length, unsigned int timeout) = NULL;
+	struct sniff_record rec;
 	int ret;
 
 	if ( ! real_libusb_bulk_transfer )
 		*(void **)(&real_libusb_bulk_transfer) = dlsym(RTLD_NEXT, "libusb_bulk_transfer");
 
+	if ( capture_fd >= 0 && ! ( ( ep & 0x80 ) ? skip_read : skip_write ) ) {
+		capture_begin(&rec, ( ep & 0x80 ) ? SNIFF_BULK_READ : SNIFF_BULK_WRITE, ep, size, timeout);
+		rec.flags |= SNIFF_FLAG_LIBUSB1;
+		ret = real_libusb_bulk_transfer(dev, ep, bytes, size, actual_length, timeout);
+		/* Store number of transferred bytes like libusb 0.1 */
+		if ( ret == 0 )
+			capture_end(&rec, *actual_length, bytes, ( ep & 0x80 ) ? *actual_length : size);
+		else
+			capture_end(&rec, ret, bytes, ( ep & 0x80 ) ? 0 : size);
+		return ret;
+	}
+
 	if ( ep == 0x81 ) {
 
 		ret = real_libusb_bulk_transfer(dev, ep, bytes, size, actual_length, timeout);
 
-		if ( ! getenv("USBSNIFF_SKIP_READ") ) {
+		if ( ! skip_read ) {
 
 			printf("\n==== usb_bulk_read (ep=%d size=%d timeout=%d) ret = %d ====\n", ep, size, timeout, (ret < 0) ? ret : *actual_length);
 			if ( ret == 0 ) {
@@ -144,7 +457,7 @@ int libusb_bulk_transfer(libusb_device_handle *dev, unsigned char ep, unsigned c
 				printf("====\n");
 			}
 
-			if ( getenv("USBSNIFF_WAIT") ) {
+			if ( wait_enter ) {
 				printf("Press ENTER"); fflush(stdout); getchar();
 			}
 
@@ -154,13 +467,13 @@ int libusb_bulk_transfer(libusb_device_handle *dev, unsigned char ep, unsigned c
 
 	} else {
 
-		if ( ! getenv("USBSNIFF_SKIP_WRITE") ) {
+		if ( ! skip_write ) {
 
 			printf("\n==== usb_bulk_write (ep=%d size=%d timeout=%d) ====\n", ep, size, timeout);
 			dump_bytes((char*) bytes, size);
 			printf("====\n");
 
-			if ( getenv("USBSNIFF_WAIT") ) {
+			if ( wait_enter ) {
 				printf("Press ENTER"); fflush(stdout); getchar();
 			}
 
@@ -175,18 +488,30 @@ int libusb_bulk_transfer(libusb_device_handle *dev, unsigned char ep, unsigned c
 int usb_control_msg(usb_dev_handle *dev, int requesttype, int request, int value, int index, char *bytes, int size, int timeout) {
 
 	static int (*real_usb_control_msg)(usb_dev_handle *dev, int requesttype, int request, int value, int index, char *bytes, int size, int timeout) = NULL;
+	struct sniff_record rec;
 	int ret;
 
 	if ( ! real_usb_control_msg )
 		*(void **)(&real_usb_control_msg) = dlsym(RTLD_NEXT, "usb_control_msg");
 
-	if ( requesttype == 64 && ! getenv("USBSNIFF_SKIP_CONTROL") ) {
+	if ( capture_fd >= 0 && ! skip_control ) {
+		capture_begin(&rec, SNIFF_CONTROL, 0, size, timeout);
+		rec.request_type = requesttype;
+		rec.request = request;
+		rec.value = value;
+		rec.index = index;
+		ret = real_usb_control_msg(dev, requesttype, request, value, index, bytes, size, timeout);
+		capture_end(&rec, ret, bytes, ( requesttype & 0x80 ) ? ret : size);
+		return ret;
+	}
+
+	if ( requesttype == 64 && ! skip_control ) {
 
 		printf("\n==== usb_control_msg(requesttype=%d, request=%d, value=%d, index=%d, size=%d, timeout=%d) ====\n", requesttype, request, value, index, size, timeout);
 		dump_bytes(bytes, size);
 		printf("====\n");
 
-		if ( getenv("USBSNIFF_WAIT") ) {
+		if ( wait_enter ) {
 			printf("Press ENTER"); fflush(stdout); getchar();
 		}
 
@@ -194,7 +519,7 @@ int usb_control_msg(usb_dev_handle *dev, int requesttype, int request, int value
 
 	ret = real_usb_control_msg(dev, requesttype, request, value, index, bytes, size, timeout);
 
-	if ( requesttype != 64 && ! getenv("USBSNIFF_SKIP_CONTROL") ) {
+	if ( requesttype != 64 && ! skip_control ) {
 
 		printf("\n==== usb_control_msg(requesttype=%d, request=%d, value=%d, index=%d, size=%d, timeout=%d) ret = %d ====\n", requesttype, request, value, index, size, timeout, ret);
 		if ( ret > 0 ) {
@@ -202,7 +527,7 @@ int usb_control_msg(usb_dev_handle *dev, int requesttype, int request, int value
 			printf("====\n");
 		}
 
-		if ( getenv("USBSNIFF_WAIT") ) {
+		if ( wait_enter ) {
 			printf("Press ENTER"); fflush(stdout); getchar();
 		}
 
@@ -215,18 +540,31 @@ int usb_control_msg(usb_dev_handle *dev, int requesttype, int request, int value
 int libusb_control_transfer(libusb_device_handle *dev, uint8_t requesttype, uint8_t request, uint16_t value, uint16_t index, unsigned char *bytes, uint16_t size, unsigned int timeout) {
 
 	static int (*real_libusb_control_transfer)(libusb_device_handle *dev, uint8_t requesttype, uint8_t request, uint16_t value, uint16_t index, unsigned char *bytes, uint16_t size, unsigned int timeout) = NULL;
+	struct sniff_record rec;
 	int ret;
 
 	if ( ! real_libusb_control_transfer )
 		*(void **)(&real_libusb_control_transfer) = dlsym(RTLD_NEXT, "libusb_control_transfer");
 
-	if ( requesttype == 64 && ! getenv("USBSNIFF_SKIP_CONTROL") ) {
+	if ( capture_fd >= 0 && ! skip_control ) {
+		capture_begin(&rec, SNIFF_CONTROL, 0, size, timeout);
+		rec.flags |= SNIFF_FLAG_LIBUSB1;
+		rec.request_type = requesttype;
+		rec.request = request;
+		rec.value = value;
+		rec.index = index;
+		ret = real_libusb_control_transfer(dev, requesttype, request, value, index, bytes, size, timeout);
+		capture_end(&rec, ret, bytes, ( requesttype & 0x80 ) ? ret : size);
+		return ret;
+	}
+
+	if ( requesttype == 64 && ! skip_control ) {
 
 		printf("\n==== usb_control_msg(requesttype=%d, request=%d, value=%d, index=%d, size=%d, timeout=%d) ====\n", (int)requesttype, (int)request, (int)value, (int)index, (int)size, (int)timeout);
 		dump_bytes((char*) bytes, size);
 		printf("====\n");
 
-		if ( getenv("USBSNIFF_WAIT") ) {
+		if ( wait_enter ) {
 			printf("Press ENTER"); fflush(stdout); getchar();
 		}
 
@@ -234,7 +572,7 @@ int libusb_control_transfer(libusb_device_handle *dev, uint8_t requesttype, uint
 
 	ret = real_libusb_control_transfer(dev, requesttype, request, value, index, bytes, size, timeout);
 
-	if ( requesttype != 64 && ! getenv("USBSNIFF_SKIP_CONTROL") ) {
+	if ( requesttype != 64 && ! skip_control ) {
 
 		printf("\n==== usb_control_msg(requesttype=%d, request=%d, value=%d, index=%d, size=%d, timeout=%d) ret = %d ====\n", (int)requesttype, (int)request, (int)value, (int)index, (int)size, (int)timeout, ret);
 		if ( ret > 0 ) {
@@ -242,7 +580,7 @@ int libusb_control_transfer(libusb_device_handle *dev, uint8_t requesttype, uint
 			printf("====\n");
 		}
 
-		if ( getenv("USBSNIFF_WAIT") ) {
+		if ( wait_enter ) {
 			printf("Press ENTER"); fflush(stdout); getchar();
 		}
 
@@ -255,10 +593,20 @@ int libusb_control_transfer(libusb_device_handle *dev, uint8_t requesttype, uint
 int usb_set_configuration(usb_dev_handle *dev, int configuration) {
 
 	static int (*real_usb_set_configuration)(usb_dev_handle *dev, int configuration) = NULL;
+	struct sniff_record rec;
+	int ret;
 
 	if ( ! real_usb_set_configuration )
 		*(void **)(&real_usb_set_configuration) = dlsym(RTLD_NEXT, "usb_set_configuration");
 
+	if ( capture_fd >= 0 ) {
+		capture_begin(&rec, SNIFF_SET_CONFIGURATION, 0, 0, 0);
+		rec.value = configuration;
+		ret = real_usb_set_configuration(dev, configuration);
+		capture_end(&rec, ret, NULL, 0);
+		return ret;
+	}
+
 	printf("\n==== usb_set_configuration (configuration=%d) ====\n", configuration);
 
 	return real_usb_set_configuration(dev, configuration);
@@ -268,10 +616,21 @@ int usb_set_configuration(usb_dev_handle *dev, int configuration) {
 int libusb_set_configuration(libusb_device_handle *dev, int configuration) {
 
 	static int (*real_usb_set_configuration)(libusb_device_handle *dev, int configuration) = NULL;
+	struct sniff_record rec;
+	int ret;
 
 	if ( ! real_usb_set_configuration )
 		*(void **)(&real_usb_set_configuration) = dlsym(RTLD_NEXT, "libusb_set_configuration");
 
+	if ( capture_fd >= 0 ) {
+		capture_begin(&rec, SNIFF_SET_CONFIGURATION, 0, 0, 0);
+		rec.flags |= SNIFF_FLAG_LIBUSB1;
+		rec.value = configuration;
+		ret = real_usb_set_configuration(dev, configuration);
+		capture_end(&rec, ret, NULL, 0);
+		return ret;
+	}
+
 	printf("\n==== usb_set_configuration (configuration=%d) ====\n", configuration);
 
 	return real_usb_set_configuration(dev, configuration);
@@ -281,10 +640,20 @@ int libusb_set_configuration(libusb_device_handle *dev, int configuration) {
 int usb_claim_interface(usb_dev_handle *dev, int interface) {
 
 	static int (*real_usb_claim_interface)(usb_dev_handle *dev, int interface) = NULL;
+	struct sniff_record rec;
+	int ret;
 
 	if ( ! real_usb_claim_interface )
 		*(void **)(&real_usb_claim_interface) = dlsym(RTLD_NEXT, "usb_claim_interface");
 
+	if ( capture_fd >= 0 ) {
+		capture_begin(&rec, SNIFF_CLAIM_INTERFACE, 0, 0, 0);
+		rec.value = interface;
+		ret = real_usb_claim_interface(dev, interface);
+		capture_end(&rec, ret, NULL, 0);
+		return ret;
+	}
+
 	printf("\n==== usb_claim_interface (interface=%d) ====\n", interface);
 
 	return real_usb_claim_interface(dev, interface);
@@ -294,10 +663,21 @@ int usb_claim_interface(usb_dev_handle *dev, int interface) {
 int libusb_claim_interface(libusb_device_handle *dev, int interface) {
 
 	static int (*real_usb_claim_interface)(libusb_device_handle *dev, int interface) = NULL;
+	struct sniff_record rec;
+	int ret;
 
 	if ( ! real_usb_claim_interface )
 		*(void **)(&real_usb_claim_interface) = dlsym(RTLD_NEXT, "libusb_claim_interface");
 
+	if ( capture_fd >= 0 ) {
+		capture_begin(&rec, SNIFF_CLAIM_INTERFACE, 0, 0, 0);
+		rec.flags |= SNIFF_FLAG_LIBUSB1;
+		rec.value = interface;
+		ret = real_usb_claim_interface(dev, interface);
+		capture_end(&rec, ret, NULL, 0);
+		return ret;
+	}
+
 	printf("\n==== usb_claim_interface (interface=%d) ====\n", interface);
 
 	return real_usb_claim_interface(dev, interface);
@@ -307,10 +687,20 @@ int libusb_claim_interface(libusb_device_handle *dev, int interface) {
 int usb_set_altinterface(usb_dev_handle *dev, int alternate) {
 
 	static int (*real_usb_set_altinterface)(usb_dev_handle *dev, int alternate) = NULL;
+	struct sniff_record rec;
+	int ret;
 
 	if ( ! real_usb_set_altinterface )
 		*(void **)(&real_usb_set_altinterface) = dlsym(RTLD_NEXT, "usb_set_altinterface");
 
+	if ( capture_fd >= 0 ) {
+		capture_begin(&rec, SNIFF_SET_ALTINTERFACE, 0, 0, 0);
+		rec.value = alternate;
+		ret = real_usb_set_altinterface(dev, alternate);
+		capture_end(&rec, ret, NULL, 0);
+		return ret;
+	}
+
 	printf("\n==== usb_set_altinterface (alternate=%d) ====\n", alternate);
 
 	return real_usb_set_altinterface(dev, alternate);
@@ -320,10 +710,22 @@ int usb_set_altinterface(usb_dev_handle *dev, int alternate) {
 int libusb_set_interface_alt_setting(libusb_device_handle *dev, int interface, int alternate) {
 
 	static int (*real_usb_set_altinterface)(libusb_device_handle *dev, int interface, int alternate) = NULL;
+	struct sniff_record rec;
+	int ret;
 
 	if ( ! real_usb_set_altinterface )
 		*(void **)(&real_usb_set_altinterface) = dlsym(RTLD_NEXT, "libusb_set_interface_alt_setting");
 
+	if ( capture_fd >= 0 ) {
+		capture_begin(&rec, SNIFF_SET_ALTINTERFACE, 0, 0, 0);
+		rec.flags |= SNIFF_FLAG_LIBUSB1;
+		rec.index = interface;
+		rec.value = alternate;
+		ret = real_usb_set_altinterface(dev, interface, alternate);
+		capture_end(&rec, ret, NULL, 0);
+		return ret;
+	}
+
 	printf("\n==== usb_set_altinterface (alternate=%d) ====\n", alternate);
 
 	return real_usb_set_altinterface(dev, interface, alternate);
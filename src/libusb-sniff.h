@@ -0,0 +1,115 @@
+/*
+    libusb-sniff.h - Binary capture format of libusb-sniff
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef LIBUSB_SNIFF_H
+#define LIBUSB_SNIFF_H
+
+#include <stdint.h>
+
+/*
+ * Capture file is sniff_header followed by sniff_record entries. Every record is followed
+ * by payload bytes of transfer and padded to multiple of 8 bytes, record size contains both.
+ * All numbers are in host byte order, structures have fixed layout without padding, so
+ * captures from 32 and 64 bit programs are same.
+ */
+
+#define SNIFF_MAGIC		"USBSNIFF"
+#define SNIFF_VERSION		1
+
+/* Payload was truncated, only first payload bytes of transfer are stored */
+#define SNIFF_FLAG_TRUNCATED	0x1
+/* Hash contains FNV-1a hash of whole transfer */
+#define SNIFF_FLAG_HASH		0x2
+/* Transfer used libusb 1.0 API */
+#define SNIFF_FLAG_LIBUSB1	0x4
+
+enum sniff_type {
+	SNIFF_BULK_WRITE = 1,
+	SNIFF_BULK_READ,
+	SNIFF_CONTROL,
+	SNIFF_SET_CONFIGURATION,
+	SNIFF_CLAIM_INTERFACE,
+	SNIFF_SET_ALTINTERFACE,
+};
+
+struct sniff_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t payload_max;
+	/* Realtime clock at start of capture */
+	uint64_t start_sec;
+	uint32_t start_nsec;
+	uint32_t reserved;
+};
+
+struct sniff_record {
+	uint32_t size;
+	uint8_t type;
+	uint8_t ep;
+	uint8_t request_type;
+	uint8_t request;
+	/* Start of call in ns since start of capture */
+	uint64_t time;
+	/* Time spent in libusb call in ns */
+	uint64_t duration;
+	/* Requested length and return value of call */
+	int32_t length;
+	int32_t status;
+	uint32_t timeout;
+	uint32_t hash;
+	uint32_t payload;
+	uint32_t flags;
+	/* Control value and index, configuration, interface or alternate setting */
+	uint16_t value;
+	uint16_t index;
+	uint32_t reserved;
+};
+
+#define SNIFF_RECORD_ALIGN	8
+
+static inline const char * sniff_type_to_string(uint8_t type) {
+
+	switch ( type ) {
+		case SNIFF_BULK_WRITE: return "usb_bulk_write";
+		case SNIFF_BULK_READ: return "usb_bulk_read";
+		case SNIFF_CONTROL: return "usb_control_msg";
+		case SNIFF_SET_CONFIGURATION: return "usb_set_configuration";
+		case SNIFF_CLAIM_INTERFACE: return "usb_claim_interface";
+		case SNIFF_SET_ALTINTERFACE: return "usb_set_altinterface";
+		default: return "unknown";
+	}
+
+}
+
+static inline uint32_t sniff_hash(const void * data, uint32_t size) {
+
+	const unsigned char * ptr = data;
+	uint32_t hash = 2166136261U;
+	uint32_t i;
+
+	for ( i = 0; i < size; ++i ) {
+		hash ^= ptr[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+
+}
+
+#endif
@@ -35,6 +35,7 @@
 #include "fiasco.h"
 #include "device.h"
 #include "operations.h"
+#include "multi.h"
 
 extern char *optarg;
 extern int optind, opterr, optopt;
@@ -62,6 +63,7 @@ static void show_usage(void) {
 
 		"Device configuration:\n"
 		" -I              identify, show all information about device\n"
+		" -A              identify all connected devices in parallel, one line per device\n"
 		" -D 0|1|2        change root device: 0 - flash, 1 - mmc, 2 - usb\n"
 		" -U 0|1          disable/enable USB host mode\n"
 		" -R 0|1          disable/enable R&D mode\n"
@@ -101,6 +103,14 @@ static void show_usage(void) {
 		" -i              identify images\n"
 		" -s              simulate, do not flash or write on disk\n"
 		" -n              disable hash, checksum and image type checking\n"
+		" -L              verify hashes of fiasco images while sending them, not when loading\n"
+		" -k              use and update cached index of fiasco image\n"
+		" -y              rebuild cached index of fiasco image\n"
+		" -j num          number of threads for counting image hashes (default: CPUs)\n"
+		" -a num          number of image buffers read ahead while sending image (default: 4)\n"
+		" -z num          send image data by num asynchronous usbfs URBs (Linux only, default: 0 - use libusb)\n"
+		" -P num          wait for num USB devices and flash or cold flash them in parallel\n"
+		" -W              repeat flashing or cold flashing for next connected devices until interrupted\n"
 		" -v              be verbose and noisy\n"
 		" -h              show this help message\n"
 		"\n"
@@ -141,6 +151,11 @@ static void show_usage(void) {
 
 int simulate;
 int noverify;
+int lazyverify;
+int indexcache;
+int threads;
+int readahead;
+int usbfs;
 int verbose;
 
 /* arg = [[[dev:[hw:]]ver:]type:]file[%%lay] */
@@ -305,6 +320,23 @@ void filter_images_by_hwrev(int16_t hwrev, struct image_list ** image_first) {
 
 }
 
+/* Clones share data with original images, so original images are not changed by flashing */
+static struct image_list * image_list_clone(struct image_list * list) {
+
+	struct image_list * clone_first = NULL;
+	struct image * clone;
+
+	for ( ; list; list = list->next ) {
+		clone = image_alloc_clone(list->image);
+		if ( ! clone )
+			break;
+		image_list_add(&clone_first, clone);
+	}
+
+	return clone_first;
+
+}
+
 static const char * image_tmp[] = {
 	[IMAGE_XLOADER] = "xloader_tmp",
 	[IMAGE_SECONDARY] = "secondary_tmp",
@@ -330,14 +362,14 @@ int main(int argc, char **argv) {
 
 	const char * optstring = ":"
 	"b:rlfcx:E:e:"
-	"ID:U:R:F:H:K:T:N:S:C:"
+	"IAD:U:R:F:H:K:T:N:S:C:"
 	"M:m:"
 	"t:d:w:"
 	"u:g:"
 	"i"
 	"p"
 	"Q"
-	"snvh"
+	"snLkyj:a:z:P:Wvh"
 	"";
 	int c;
 
@@ -360,6 +392,7 @@ int main(int argc, char **argv) {
 	int dev_flash = 0;
 	int dev_reboot = 0;
 	int dev_ident = 0;
+	int dev_ident_all = 0;
 
 	int set_root = 0;
 	char * set_root_arg = NULL;
@@ -399,6 +432,14 @@ int main(int argc, char **argv) {
 
 	int image_ident = 0;
 
+	int planned = 0;
+	int planned_cold = 0;
+	int parallel = 0;
+	int repeat = 0;
+	int repeat_cold_flash = 0;
+	int repeat_set_sw = 0;
+	struct image_list * image_repeat = NULL;
+
 	int help = 0;
 
 	struct image_list * image_first = NULL;
@@ -409,6 +450,7 @@ int main(int argc, char **argv) {
 	int have_kernel = 0;
 	int have_initfs = 0;
 	struct image * image_2nd = NULL;
+	int keep_2nd = 0;
 	struct image * image_secondary = NULL;
 	struct image_list * image_kernel = NULL;
 	struct image_list * image_initfs = NULL;
@@ -434,6 +476,11 @@ int main(int argc, char **argv) {
 
 	simulate = 0;
 	noverify = 0;
+	lazyverify = 0;
+	indexcache = 0;
+	threads = 0;
+	readahead = 4;
+	usbfs = 0;
 	verbose = 0;
 
 	show_title();
@@ -518,6 +565,9 @@ int main(int argc, char **argv) {
 			case 'I':
 				dev_ident = 1;
 				break;
+			case 'A':
+				dev_ident_all = 1;
+				break;
 			case 'D':
 				set_root = 1;
 				set_root_arg = optarg;
@@ -602,6 +652,51 @@ int main(int argc, char **argv) {
 			case 'n':
 				noverify = 1;
 				break;
+			case 'L':
+				lazyverify = 1;
+				break;
+			case 'k':
+				if ( ! indexcache )
+					indexcache = 1;
+				break;
+			case 'y':
+				indexcache = 2;
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				if ( threads < 1 ) {
+					ERROR("Invalid number of threads '%s'", optarg);
+					ret = 1;
+					goto clean;
+				}
+				break;
+			case 'a':
+				readahead = atoi(optarg);
+				if ( readahead < 1 ) {
+					ERROR("Invalid number of buffers '%s'", optarg);
+					ret = 1;
+					goto clean;
+				}
+				break;
+			case 'z':
+				usbfs = atoi(optarg);
+				if ( usbfs < 0 ) {
+					ERROR("Invalid number of URBs '%s'", optarg);
+					ret = 1;
+					goto clean;
+				}
+				break;
+			case 'P':
+				parallel = atoi(optarg);
+				if ( parallel < 1 ) {
+					ERROR("Invalid number of devices '%s'", optarg);
+					ret = 1;
+					goto clean;
+				}
+				break;
+			case 'W':
+				repeat = 1;
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -614,6 +709,14 @@ int main(int argc, char **argv) {
 
 	}
 
+	if ( threads == 0 ) {
+#ifdef _SC_NPROCESSORS_ONLN
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if ( threads < 1 )
+			threads = 1;
+	}
+
 	if ( optind < argc ) {
 		ERROR("Extra argument '%s'", argv[optind]);
 		ret = 1;
@@ -628,10 +731,12 @@ int main(int argc, char **argv) {
 		do_something = 1;
 	if ( dev_check || dev_dump_fiasco || dev_dump )
 		do_something = 1;
-	if ( dev_flash || dev_reboot || dev_ident || set_root || set_usb || set_rd || set_rd_flags || set_hw || set_kernel || set_initfs || set_nolo || set_sw || set_emmc )
+	if ( dev_flash || dev_reboot || dev_ident || dev_ident_all || set_root || set_usb || set_rd || set_rd_flags || set_hw || set_kernel || set_initfs || set_nolo || set_sw || set_emmc )
 		do_something = 1;
 	if ( fiasco_un || fiasco_gen || image_ident )
 		do_something = 1;
+	if ( indexcache == 2 && image_fiasco )
+		do_something = 1;
 	if ( help )
 		do_something = 1;
 
@@ -657,6 +762,9 @@ int main(int argc, char **argv) {
 		goto clean;
 	}
 
+	if ( indexcache == 2 && ( lazyverify || noverify ) )
+		WARNING("Fiasco index is not updated without hash verification");
+
 	/* load fiasco image */
 	if ( image_fiasco ) {
 		fiasco_in = fiasco_alloc_from_file(image_fiasco_arg);
@@ -780,7 +888,14 @@ int main(int argc, char **argv) {
 			if ( image_ptr->image->type == IMAGE_2ND ) {
 				if ( image_ptr == image_first )
 					image_first = next;
-				image_list_del(image_ptr);
+				/* 2nd image is still needed for cold flashing, it is freed at end */
+				if ( dev_cold_flash && image_ptr->image == image_2nd ) {
+					image_list_unlink(image_ptr);
+					free(image_ptr);
+					keep_2nd = 1;
+				} else {
+					image_list_del(image_ptr);
+				}
 			}
 			image_ptr = next;
 		}
@@ -815,7 +930,10 @@ int main(int argc, char **argv) {
 			ret = 1;
 			goto clean;
 		}
-		fiasco_unpack(fiasco_in, fiasco_un_arg);
+		if ( fiasco_unpack(fiasco_in, fiasco_un_arg) < 0 ) {
+			ret = 1;
+			goto clean;
+		}
 	}
 
 	/* remove unknown images */
@@ -856,9 +974,13 @@ int main(int argc, char **argv) {
 			if ( swver )
 				strcpy(fiasco_out->swver, swver);
 			fiasco_out->first = image_first;
-			fiasco_write_to_file(fiasco_out, fiasco_gen_arg);
+			ret = fiasco_write_to_file(fiasco_out, fiasco_gen_arg);
 			fiasco_out->first = NULL;
 			fiasco_free(fiasco_out);
+			if ( ret < 0 ) {
+				ret = 1;
+				goto clean;
+			}
 		}
 	}
 
@@ -902,6 +1024,46 @@ int main(int argc, char **argv) {
 		goto clean;
 	}
 
+	/* identify all devices */
+	if ( dev_ident_all ) {
+		ret = multi_identify();
+		ret = ( ret != 0 ) ? 1 : 0;
+		goto clean;
+	}
+
+	/* parallel flashing */
+	if ( parallel ) {
+		if ( ! dev_flash && ! dev_cold_flash ) {
+			ERROR("Option -P can be used only for flashing or cold flashing");
+			ret = 1;
+			goto clean;
+		}
+		if ( dev_boot || dev_load || dev_ident || dev_check || dev_dump_fiasco || dev_dump
+			|| set_root || set_usb || set_rd || set_rd_flags || set_hw || set_kernel || set_initfs || set_nolo || set_sw || set_emmc ) {
+			ERROR("Option -P cannot be used with other device operations than flashing and reboot");
+			ret = 1;
+			goto clean;
+		}
+		ret = multi_flash(dev_flash ? image_first : NULL, dev_cold_flash ? image_2nd : NULL, dev_cold_flash ? image_secondary : NULL, parallel, dev_reboot);
+		ret = ( ret != 0 ) ? 1 : 0;
+		goto clean;
+	}
+
+	/* repeat mode, keep loaded and verified images for next devices */
+	if ( repeat ) {
+		if ( ! dev_flash && ! dev_cold_flash ) {
+			ERROR("Option -W can be used only for flashing or cold flashing");
+			ret = 1;
+			goto clean;
+		}
+		repeat_cold_flash = dev_cold_flash;
+		repeat_set_sw = set_sw;
+		image_repeat = image_first;
+		image_first = image_list_clone(image_repeat);
+		if ( fiasco_in )
+			fiasco_in->first = image_first;
+	}
+
 	/* operations */
 	if ( do_device ) {
 
@@ -923,7 +1085,19 @@ int main(int argc, char **argv) {
 			/* cold flash */
 			if ( dev_cold_flash ) {
 
+				/* images for flashing are planned after device is detected and images are filtered */
+				if ( ! planned_cold ) {
+					if ( dev_flash_plan(dev, NULL, image_2nd, image_secondary) < 0 ) {
+						ret = 1;
+						goto clean;
+					}
+					printf("\n");
+					planned_cold = 1;
+				}
+
 				ret = dev_cold_flash_images(dev, image_2nd, image_secondary);
+				if ( repeat && ret == 0 && ! dev_flash && dev->usb )
+					usb_device_finished(dev->usb);
 				dev_free(dev);
 				dev = NULL;
 
@@ -941,6 +1115,16 @@ int main(int argc, char **argv) {
 					continue;
 				}
 
+				if ( repeat ) {
+					printf("\nDone, connect next device\n");
+					if ( usb_wait_for_next_device() < 0 )
+						break;
+					planned = 0;
+					planned_cold = 0;
+					again = 1;
+					continue;
+				}
+
 				break;
 
 			}
@@ -1039,6 +1223,18 @@ int main(int argc, char **argv) {
 			if ( fiasco_in && ( detected_device || detected_hwrev ) )
 				fiasco_in->first = image_first;
 
+			/* order filtered images for the fewest mode switches, only once as every switch keeps planned order */
+			if ( ! planned && dev_flash ) {
+				if ( dev_flash_plan(dev, &image_first, NULL, NULL) < 0 ) {
+					ret = 1;
+					goto clean;
+				}
+				if ( fiasco_in )
+					fiasco_in->first = image_first;
+				printf("\n");
+				planned = 1;
+			}
+
 			/* set kernel and initfs images for loading */
 			if ( dev_load ) {
 				image_ptr = image_first;
@@ -1123,12 +1319,26 @@ int main(int argc, char **argv) {
 
 			/* flash */
 			if ( dev_flash ) {
+				struct image_prefetch * prefetch = NULL;
 				image_ptr = image_first;
 				while ( image_ptr ) {
 					struct image_list * next = image_ptr->next;
+					/* Read next image while device is busy with current image, corrupted image is not sent at all */
+					if ( image_prefetch_finish(prefetch) < 0 ) {
+						ERROR("Image %s is corrupted", image_type_to_string(image_ptr->image->type));
+						ret = 1;
+						goto clean;
+					}
+					prefetch = next ? image_prefetch_start(next->image) : NULL;
 					ret = dev_flash_image(dev, image_ptr->image);
-					if ( ret < 0 )
+					if ( ret < 0 ) {
+						if ( image_prefetch_finish(prefetch) < 0 ) {
+							ERROR("Image %s is corrupted", image_type_to_string(next->image->type));
+							ret = 1;
+							goto clean;
+						}
 						goto again;
+					}
 
 					if ( image_ptr == image_first )
 						image_first = image_first->next;
@@ -1393,15 +1603,38 @@ int main(int argc, char **argv) {
 			}
 
 			/* boot */
-			if ( dev_boot ) {
+			if ( dev_boot )
 				dev_boot_device(dev, dev_boot_arg);
-				break;
-			}
 
 			/* reboot */
-			if ( dev_reboot ) {
+			else if ( dev_reboot )
 				dev_reboot_device(dev);
-				break;
+
+			/* repeat for next device */
+			if ( repeat ) {
+				if ( dev->usb )
+					usb_device_finished(dev->usb);
+				dev_free(dev);
+				dev = NULL;
+				printf("\nDone, connect next device\n");
+				if ( usb_wait_for_next_device() < 0 )
+					break;
+				image_ptr = image_first;
+				while ( image_ptr ) {
+					struct image_list * next = image_ptr->next;
+					image_list_del(image_ptr);
+					image_ptr = next;
+				}
+				image_first = image_list_clone(image_repeat);
+				if ( fiasco_in )
+					fiasco_in->first = image_first;
+				dev_cold_flash = repeat_cold_flash;
+				set_sw = repeat_set_sw;
+				have_kernel = 0;
+				have_initfs = 0;
+				planned = 0;
+				planned_cold = 0;
+				again = 1;
 			}
 
 			continue;
@@ -1429,9 +1662,20 @@ clean:
 		}
 	}
 
+	if ( keep_2nd )
+		image_free(image_2nd);
+
 	if ( fiasco_in )
 		fiasco_free(fiasco_in);
 
+	/* original images must be freed after their clones */
+	image_ptr = image_repeat;
+	while ( image_ptr ) {
+		struct image_list * next = image_ptr->next;
+		image_list_del(image_ptr);
+		image_ptr = next;
+	}
+
 	if ( dev )
 		dev_free(dev);
 
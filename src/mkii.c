@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <arpa/inet.h>
 
@@ -29,6 +30,7 @@
 #include "device.h"
 #include "usb-device.h"
 #include "printf-utils.h"
+#include "usbfs.h"
 
 #define MKII_OUT	0x8810001B
 #define MKII_IN		0x8800101B
@@ -36,9 +38,18 @@
 #define MKII_PING	0x00
 #define MKII_GET	0x01
 #define MKII_TELL	0x02
+#define MKII_IMAGE_BEGIN	0x03
+#define MKII_IMAGE_HEADER	0x04
+#define MKII_IMAGE_CHANNEL	0x05
+#define MKII_CHUNK_STATUS	0x06
+#define MKII_CHUNK_SEND		0x08
+#define MKII_CHUNK_QUERY	0x0B
 #define MKII_REBOOT	0x0C
 #define MKII_RESPONCE	0x20
 
+/* Size of image chunk sent over usb:raw channel */
+#define MKII_CHUNK_SIZE	0x100000
+
 struct mkii_message {
 	uint32_t header;
 	uint16_t size;
@@ -49,34 +60,54 @@ struct mkii_message {
 } __attribute__((__packed__));
 
 
-static int mkii_send_receive(usb_dev_handle * udev, uint8_t type, struct mkii_message * in_msg, size_t data_size, struct mkii_message * out_msg, size_t out_size) {
+/* Maximal number of Mk II messages waiting for response */
+#define MKII_QUEUE_MAX	8
+
+/* Request in queue, response is stored to out (without message header) */
+struct mkii_request {
+	uint8_t type;
+	const char * data;
+	size_t size;
+	char * out;
+	size_t out_size;
+	uint8_t num;
+	int pending;
+	int ret;
+};
+
+static int mkii_send(struct usb_device_info * dev, uint8_t type, struct mkii_message * in_msg, size_t data_size) {
 
 	int ret;
-	static uint8_t number = 0;
 
 	in_msg->header = MKII_OUT;
 	in_msg->size = htons(data_size + 4);
 	in_msg->zero = 0;
-	in_msg->num = number++;
+	in_msg->num = dev->seq++;
 	in_msg->type = type;
 
-	ret = usb_bulk_write(udev, USB_WRITE_EP, (char *)in_msg, data_size + sizeof(*in_msg), 5000);
+	ret = usb_bulk_write(dev->udev, USB_WRITE_EP, (char *)in_msg, data_size + sizeof(*in_msg), 5000);
 	if ( ret < 0 )
 		return ret;
 	if ( (size_t)ret != data_size + sizeof(*in_msg) )
 		return -1;
 
-	ret = usb_bulk_read(udev, USB_READ_EP, (char *)out_msg, out_size, 5000);
+	return in_msg->num;
+
+}
+
+/* Receive one message, return size of its data */
+static int mkii_receive(struct usb_device_info * dev, struct mkii_message * out_msg, size_t out_size, int timeout) {
+
+	int ret;
+
+	ret = usb_bulk_read(dev->udev, USB_READ_EP, (char *)out_msg, out_size, timeout);
 	if ( ret < 0 )
 		return ret;
 
-	if ( out_msg->header != MKII_IN )
-		return -1;
-
-	if ( out_msg->type != (type | MKII_RESPONCE) )
+	if ( (size_t)ret < sizeof(*out_msg) )
 		return -1;
 
-	if ( (size_t)ret < sizeof(*out_msg) )
+	if ( out_msg->header != MKII_IN )
 		return -1;
 
 	if ( ntohs(out_msg->size) != ret - sizeof(*out_msg) + 4 )
@@ -86,42 +117,154 @@ static int mkii_send_receive(usb_dev_handle * udev, uint8_t type, struct mkii_me
 
 }
 
+static int mkii_send_receive(struct usb_device_info * dev, uint8_t type, struct mkii_message * in_msg, size_t data_size, struct mkii_message * out_msg, size_t out_size) {
+
+	int ret;
+
+	ret = mkii_send(dev, type, in_msg, data_size);
+	if ( ret < 0 )
+		return ret;
+
+	ret = mkii_receive(dev, out_msg, out_size, 5000);
+	if ( ret < 0 )
+		return ret;
+
+	if ( out_msg->type != (type | MKII_RESPONCE) )
+		return -1;
+
+	return ret;
+
+}
+
+/*
+ * Send independent requests back to back and match responses by message number.
+ * Response with unknown number is matched to the oldest pending request of same type.
+ * Return -1 on transfer error, otherwise result of every request is in its ret
+ */
+static int mkii_send_receive_queue(struct usb_device_info * dev, struct mkii_request * reqs, int count) {
+
+	char buf[2048];
+	struct mkii_message * msg = (struct mkii_message *)buf;
+	struct mkii_request * req;
+	int next = 0;
+	int pending = 0;
+	int ret;
+	int i;
+
+	for ( i = 0; i < count; ++i ) {
+		reqs[i].pending = 0;
+		reqs[i].ret = -1;
+	}
+
+	while ( next < count || pending > 0 ) {
+
+		/* Fill queue */
+		while ( next < count && pending < MKII_QUEUE_MAX ) {
+			req = &reqs[next++];
+			if ( req->size > sizeof(buf) - sizeof(*msg) )
+				return -1;
+			memcpy(msg->data, req->data, req->size);
+			ret = mkii_send(dev, req->type, msg, req->size);
+			if ( ret < 0 )
+				return -1;
+			req->num = ret;
+			req->pending = 1;
+			++pending;
+		}
+
+		ret = mkii_receive(dev, msg, sizeof(buf), 5000);
+		if ( ret < 0 )
+			return -1;
+
+		req = NULL;
+		for ( i = 0; i < next; ++i ) {
+			if ( reqs[i].pending && reqs[i].num == msg->num && msg->type == (reqs[i].type | MKII_RESPONCE) ) {
+				req = &reqs[i];
+				break;
+			}
+		}
+
+		for ( i = 0; ! req && i < next; ++i )
+			if ( reqs[i].pending && msg->type == (reqs[i].type | MKII_RESPONCE) )
+				req = &reqs[i];
+
+		if ( ! req )
+			return -1;
+
+		req->pending = 0;
+		--pending;
+
+		if ( (size_t)ret <= req->out_size ) {
+			memcpy(req->out, msg->data, ret);
+			req->ret = ret;
+		}
+
+	}
+
+	return 0;
+
+}
+
 int mkii_init(struct usb_device_info * dev) {
 
 	char buf[2048];
-	struct mkii_message * msg;
+	char version[64];
+	char tell[64];
+	char product[64];
+	char hwrev[64];
+	char images[1024];
+	struct mkii_request reqs[] = {
+		{ MKII_PING, NULL, 0, tell, sizeof(tell)-1, 0, 0, 0 },
+		{ MKII_GET, "/update/protocol_version", sizeof("/update/protocol_version")-1, version, sizeof(version)-1, 0, 0, 0 },
+		{ MKII_TELL, "/update/host_protocol_version\x00\x32", sizeof("/update/host_protocol_version\x00\x32")-1, tell, sizeof(tell)-1, 0, 0, 0 },
+		{ MKII_GET, "/device/product_code", sizeof("/device/product_code")-1, product, sizeof(product)-1, 0, 0, 0 },
+		{ MKII_GET, "/device/hw_build", sizeof("/device/hw_build")-1, hwrev, sizeof(hwrev)-1, 0, 0, 0 },
+		{ MKII_GET, "/update/supported_images", sizeof("/update/supported_images")-1, images, sizeof(images)-1, 0, 0, 0 },
+	};
 	enum device device;
 	int ret;
+	int i;
 	char * newptr;
 	char * ptr;
 	enum image_type type;
 
 	printf("Initializing Mk II protocol...\n");
 
-	msg = (struct mkii_message *)buf;
+	/* All requests are independent, so they are sent at once and device is waited only for one round trip */
+	ret = mkii_send_receive_queue(dev, reqs, sizeof(reqs)/sizeof(reqs[0]));
+	if ( ret < 0 ) {
+		/* Device may not accept more messages at once, drop stale responses and send them one by one */
+		VERBOSE("Mk II request queue failed, sending requests one by one\n");
+		while ( mkii_receive(dev, (struct mkii_message *)buf, sizeof(buf), 100) >= 0 );
+		for ( i = 0; i < (int)(sizeof(reqs)/sizeof(reqs[0])); ++i )
+			if ( mkii_send_receive_queue(dev, &reqs[i], 1) < 0 )
+				reqs[i].ret = -1;
+	}
 
-	ret = mkii_send_receive(dev->udev, MKII_PING, msg, 0, msg, sizeof(buf));
-	if ( ret != 0 )
+	if ( reqs[0].ret != 0 )
 		ERROR_RETURN("Cannot ping device", -1);
 
-	memcpy(msg->data, "/update/protocol_version", sizeof("/update/protocol_version")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/update/protocol_version")-1, msg, sizeof(buf));
-	if ( ret < 2 || msg->data[0] != 0 )
+	ret = reqs[1].ret;
+	if ( ret < 2 || version[0] != 0 )
 		ERROR_RETURN("Cannot get Mk II protocol version", -1);
 
-	msg->data[ret] = 0;
+	version[ret] = 0;
 
-	if ( ret == 2 && msg->data[1] == 0x32 )
+	if ( ret == 2 && version[1] == 0x32 )
 		dev->data |= MKII_SUPPORT_SW_RELEASE;
 
-	printf("Detected Mk II protocol version: %s\n", msg->data);
+	printf("Detected Mk II protocol version: %s\n", version+1);
 
-	memcpy(msg->data, "/update/host_protocol_version\x00\x32", sizeof("/update/host_protocol_version\x00\x32")-1);
-	ret = mkii_send_receive(dev->udev, MKII_TELL, msg, sizeof("/update/host_protocol_version\x00\x32")-1, msg, sizeof(buf));
-	if ( ret != 1 || msg->data[0] != 0 )
+	if ( reqs[2].ret != 1 || tell[0] != 0 )
 		ERROR_RETURN("Cannot send our protocol version", -1);
 
-	device = mkii_get_device(dev);
+	ret = reqs[3].ret;
+	if ( ret < 2 || product[0] != 0 || product[1] == 0 ) {
+		device = DEVICE_UNKNOWN;
+	} else {
+		product[ret] = 0;
+		device = device_from_string(product+1);
+	}
 
 	if ( ! dev->device )
 		dev->device = device;
@@ -131,15 +274,21 @@ int mkii_init(struct usb_device_info * dev) {
 		return -1;
 	}
 
-	dev->hwrev = mkii_get_hwrev(dev);
+	ret = reqs[4].ret;
+	if ( ret < 2 || hwrev[0] != 0 || hwrev[1] == 0 ) {
+		ERROR("Cannot get hw revision");
+		dev->hwrev = -1;
+	} else {
+		hwrev[ret] = 0;
+		dev->hwrev = atoi(hwrev+1);
+	}
 
-	memcpy(msg->data, "/update/supported_images", sizeof("/update/supported_images")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/update/supported_images")-1, msg, sizeof(buf));
-	if ( ret < 2 || msg->data[0] != 0 )
+	ret = reqs[5].ret;
+	if ( ret < 2 || images[0] != 0 )
 		ERROR_RETURN("Cannot get supported image types", -1);
 
-	msg->data[ret] = 0;
-	ptr = msg->data + 1;
+	images[ret] = 0;
+	ptr = images + 1;
 
 	printf("Supported images by current device configuration:");
 
@@ -180,7 +329,7 @@ enum device mkii_get_device(struct usb_device_info * dev) {
 	msg = (struct mkii_message *)buf;
 
 	memcpy(msg->data, "/device/product_code", sizeof("/device/product_code")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/device/product_code")-1, msg, sizeof(buf));
+	ret = mkii_send_receive(dev, MKII_GET, msg, sizeof("/device/product_code")-1, msg, sizeof(buf));
 	if ( ret < 2 || msg->data[0] != 0 || msg->data[1] == 0 )
 		return DEVICE_UNKNOWN;
 
@@ -190,19 +339,25 @@ enum device mkii_get_device(struct usb_device_info * dev) {
 }
 
 int mkii_flash_image(struct usb_device_info * dev, struct image * image) {
-	ERROR("%s", usb_strerror());
+
 	char buf1[512];
 	char buf[2048];
 	struct mkii_message * msg1;
 	struct mkii_message * msg;
 	char * ptr;
 	const char * type;
+	const void * data;
+	struct image_reader * reader;
+	struct usbfs_stream * stream;
+	struct timespec start, end;
+	double duration;
 	uint8_t len;
 	uint16_t hash;
 	uint32_t size;
+	uint32_t sent;
+	size_t count;
 	int ret;
 
-
 	if ( ! ( dev->data & (1UL << image->type) ) ) {
 		ERROR("Flashing image %s is not supported in current device configuration", image_type_to_string(image->type));
 		return -1;
@@ -324,91 +479,122 @@ int mkii_flash_image(struct usb_device_info * dev, struct image * image) {
 	memcpy(ptr, "\x00", 1);
 	ptr += 1;
 
-	ret = mkii_send_receive(dev->udev, MKII_PING, msg, 0, msg, sizeof(buf));
+	ret = mkii_send_receive(dev, MKII_PING, msg1, 0, msg1, sizeof(buf1));
 	if ( ret != 0 )
 		ERROR_RETURN("Cannot ping device", -1);
 
-	ret = mkii_send_receive(dev->udev, 0x03, msg1, 0, msg1, sizeof(buf1));
-	if ( ret != 1 || msg1->data[0] != 0 ) {
-		ERROR("Sending stuff failed; ret: %d", ret);
-		return -1;
-	}
+	/* Separate message, image header in msg is sent after this */
+	ret = mkii_send_receive(dev, MKII_IMAGE_BEGIN, msg1, 0, msg1, sizeof(buf1));
+	if ( ret != 1 || msg1->data[0] != 0 )
+		ERROR_RETURN("Cannot start sending image", -1);
 
-	ret = mkii_send_receive(dev->udev, 0x04, msg, ptr - msg->data, msg, sizeof(buf));
-	if ( ret != 9 ) {
-		ERROR("Sending subimage header failed");
-		return -1;
-	}
+	ret = mkii_send_receive(dev, MKII_IMAGE_HEADER, msg, ptr - msg->data, msg, sizeof(buf));
+	if ( ret != 9 )
+		ERROR_RETURN("Sending image header failed", -1);
 
-	/* tx type(?) */
+	/* Image data are sent over raw usb bulk endpoint */
 	len = 4 + 7;
 	memcpy(msg->data, "\0\0\0\0usb:raw", len);
-	ret = mkii_send_receive(dev->udev, 0x05, msg, len, msg, sizeof(buf));
-	if ( ret != 1 || msg1->data[0] != 0 ) {
-		ERROR("Sending tx type failed");
+	ret = mkii_send_receive(dev, MKII_IMAGE_CHANNEL, msg, len, msg, sizeof(buf));
+	if ( ret != 1 || msg->data[0] != 0 )
+		ERROR_RETURN("Cannot select usb:raw channel", -1);
+
+	printf("Sending and flashing image...\n");
+	printf_progressbar(0, image->size);
+
+	/* Next chunk is read by separate thread while control messages and current chunk are sent */
+	reader = image_reader_start(image, MKII_CHUNK_SIZE, readahead);
+	if ( ! reader ) {
+		PRINTF_END();
 		return -1;
 	}
 
-	int rv = 0;
-	const unsigned data_buf_size = 1048576;
-	char *data_buf = malloc(data_buf_size);
-	unsigned sent = 0;
-	printf("Sending and flashing image...\n");
-	//printf_progressbar(0, image->size);
-	image_seek(image, 0);
-	while ( sent < image-> size ) {
-		len = 4;
-		memcpy(msg->data, "\0\0\0\0", len);
-		ret = mkii_send_receive(dev->udev, 0x06, msg, len, msg, sizeof(buf));
-		if ( ret != 21 || msg->type != 0x26 ) {
-			ERROR("Sending image chunk header0 failed");
-			rv = -1;
-			goto free_data_buf;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = 0;
+	sent = 0;
+	while ( sent < image->size ) {
+
+		data = image_reader_next(reader, &count);
+		if ( ! data ) {
+			ret = -1;
+			break;
 		}
 
-		len = 4;
-		memcpy(msg->data, "\0\0\0@", len);
-		ret = mkii_send_receive(dev->udev, 0x0B, msg, len, msg, sizeof(buf));
-		if ( ret != 13 || msg->type != 0x2B ) {
-			ERROR("Sending image chunk header1 failed");
-			rv = -1;
-			goto free_data_buf;
+		memcpy(msg->data, "\0\0\0\0", 4);
+		if ( mkii_send_receive(dev, MKII_CHUNK_STATUS, msg, 4, msg, sizeof(buf)) != 21 ) {
+			PRINTF_ERROR("Image chunk status failed");
+			ret = -1;
+			break;
 		}
 
-		len = 4;
-		memcpy(msg->data, "\0\0\0\0\0\x10\0\0", len);
-		ret = mkii_send_receive(dev->udev, 0x08, msg, len, msg, sizeof(buf));
-		if ( ret != 1 || msg->type != 0x28 ) {
-			ERROR("Sending image chunk header2 failed, ret: %d", ret);
-			rv = -1;
-			goto free_data_buf;
+		memcpy(msg->data, "\0\0\0@", 4);
+		if ( mkii_send_receive(dev, MKII_CHUNK_QUERY, msg, 4, msg, sizeof(buf)) != 13 ) {
+			PRINTF_ERROR("Image chunk query failed");
+			ret = -1;
+			break;
 		}
 
-		unsigned to_read = data_buf_size;
-		while (to_read) {
-			to_read -= image_read(image, data_buf, to_read);
-			if ( ret == 0 )
-				break;
+		/* Zero and size of following chunk */
+		size = htonl(count);
+		memcpy(msg->data, "\0\0\0\0", 4);
+		memcpy(msg->data + 4, &size, 4);
+		if ( mkii_send_receive(dev, MKII_CHUNK_SEND, msg, 8, msg, sizeof(buf)) != 1 || msg->data[0] != 0 ) {
+			PRINTF_ERROR("Image chunk header failed");
+			ret = -1;
+			break;
+		}
+
+		/* Keep more bulk transfers of chunk in flight if usbfs can be used */
+		stream = NULL;
+		if ( ! simulate && usbfs > 0 )
+			stream = usbfs_stream_open(dev, USB_WRITE_DATA_EP, usbfs, usb_transfer_timeout(dev, count));
+
+		if ( stream ) {
+			if ( usbfs_stream_write(stream, data, count) < 0 )
+				ret = -1;
+			if ( usbfs_stream_close(stream) < 0 )
+				ret = -1;
+		} else if ( ! simulate ) {
+			if ( usb_bulk_write(dev->udev, USB_WRITE_DATA_EP, (char *)data, count, usb_transfer_timeout(dev, count)) != (int)count )
+				ret = -1;
 		}
-		int to_send = data_buf_size - to_read;
-		printf("s %d\n", to_send);
-		ret = usb_bulk_write(dev->udev, USB_WRITE_DATA_EP, data_buf, 4096, 5000);
-		if ( ret != to_send ) {
-			ERROR("Sending image failed, ret: %d", ret);
-			ERROR("%s", usb_strerror());
-			rv = -1;
-			goto free_data_buf;
+
+		if ( ret < 0 ) {
+			PRINTF_ERROR("Sending image failed");
+			break;
 		}
-		sent += ret;
-		//printf_progressbar(sent, image->size);
+
+		sent += count;
+		printf_progressbar(sent, image->size);
+
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	image_reader_stop(reader);
+
+	if ( ret < 0 )
+		return -1;
+
+	duration = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+	if ( duration > 0 ) {
+		usb_transfer_done(dev, sent, duration * 1000);
+		printf("Sent %u bytes in %.2f s (%.1f kB/s)\n", (unsigned int)sent, duration, sent / duration / 1024);
 	}
-	printf("Sending image finished");
 
-free_data_buf:
-	free(data_buf);
+	if ( image_hash_verify(image) < 0 )
+		ERROR_RETURN("Image is corrupted", -1);
+
+	/* Wait until device finishes flashing of last chunk */
+	memcpy(msg->data, "\0\0\0\0", 4);
+	if ( mkii_send_receive(dev, MKII_CHUNK_STATUS, msg, 4, msg, sizeof(buf)) != 21 )
+		ERROR_RETURN("Finishing flashing failed", -1);
+
+	printf("Done\n");
+
+	return 0;
 
-	exit(1);
-	return rv;
 }
 
 int mkii_reboot_device(struct usb_device_info * dev, int update) {
@@ -432,7 +618,7 @@ int mkii_reboot_device(struct usb_device_info * dev, int update) {
 	}
 
 	memcpy(msg->data, str, len);
-	ret = mkii_send_receive(dev->udev, MKII_REBOOT, msg, len, msg, sizeof(buf));
+	ret = mkii_send_receive(dev, MKII_REBOOT, msg, len, msg, sizeof(buf));
 	if ( ret != 1 || msg->data[0] != 0 )
 		ERROR_RETURN("Cannot send reboot command", -1);
 
@@ -519,7 +705,7 @@ int16_t mkii_get_hwrev(struct usb_device_info * dev) {
 	msg = (struct mkii_message *)buf;
 
 	memcpy(msg->data, "/device/hw_build", sizeof("/device/hw_build")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/device/hw_build")-1, msg, sizeof(buf));
+	ret = mkii_send_receive(dev, MKII_GET, msg, sizeof("/device/hw_build")-1, msg, sizeof(buf));
 	if ( ret < 2 || msg->data[0] != 0 || msg->data[1] == 0 )
 		ERROR_RETURN("Cannot get hw revision", -1);
 
@@ -606,7 +792,7 @@ int mkii_get_sw_ver(struct usb_device_info * dev, char * ver, size_t size) {
 	msg = (struct mkii_message *)buf;
 
 	memcpy(msg->data, "/version/sw_release", sizeof("/version/sw_release")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/version/sw_release")-1, msg, sizeof(buf));
+	ret = mkii_send_receive(dev, MKII_GET, msg, sizeof("/version/sw_release")-1, msg, sizeof(buf));
 	if ( ret < 2 || msg->data[0] != 0 || msg->data[1] == 0 )
 		ERROR_RETURN("Cannot get sw release", -1);
 
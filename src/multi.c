@@ -0,0 +1,656 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "global.h"
+#include "crc32.h"
+#include "image.h"
+#include "device.h"
+#include "usb-device.h"
+#include "operations.h"
+#include "printf-utils.h"
+#include "usbfs.h"
+#include "multi.h"
+
+/* Device which needs more connections is probably in reboot loop */
+#define MULTI_CONNECT_MAX 16
+
+enum multi_state {
+	MULTI_WAITING = 0,
+	MULTI_RUNNING,
+	MULTI_DONE,
+	MULTI_FAILED,
+};
+
+struct multi;
+
+/* Device is identified by USB port, so it is same after device reconnects in other mode */
+struct multi_port {
+	struct multi * multi;
+	char path[64];
+	struct usb_device_info * usb;
+	pthread_t thread;
+	int running;
+	int connects;
+
+	/* Flashing progress, used only by worker */
+	int cold_flashed;
+	int next;
+
+	/* Protected by mutex */
+	enum multi_state state;
+	int finished;
+	char status[64];
+	int percent;
+};
+
+struct multi {
+	struct image ** images;
+	int count;
+	struct image * x2nd;
+	struct image * secondary;
+	int reboot;
+
+	pthread_mutex_t mutex;
+	struct multi_port * ports;
+	int ports_count;
+};
+
+/* Identification of device connected by USB port */
+struct multi_ident {
+	char path[64];
+	const char * protocol;
+	struct usb_device_info * usb;
+	pthread_t thread;
+	int running;
+	int ok;
+	enum device device;
+	int16_t hwrev;
+	char nolo_ver[128];
+	char kernel_ver[128];
+	char initfs_ver[128];
+	char sw_ver[128];
+	char content_ver[128];
+};
+
+static volatile sig_atomic_t signal_quit;
+
+static void signal_handler(int signum) {
+
+	signal_quit = 1;
+	/* Second signal terminates program */
+	signal(signum, SIG_DFL);
+
+}
+
+static void multi_status(struct multi_port * port, const char * format, ...) {
+
+	va_list ap;
+
+	pthread_mutex_lock(&port->multi->mutex);
+	va_start(ap, format);
+	vsnprintf(port->status, sizeof(port->status), format, ap);
+	va_end(ap);
+	port->percent = -1;
+	pthread_mutex_unlock(&port->multi->mutex);
+
+}
+
+static void multi_progress(unsigned long long part, unsigned long long total, void * data) {
+
+	struct multi_port * port = data;
+
+	pthread_mutex_lock(&port->multi->mutex);
+	port->percent = total == 0 ? 100 : (int)(part*100/total);
+	pthread_mutex_unlock(&port->multi->mutex);
+
+}
+
+static int multi_image_is_valid(struct image * image, struct device_info * dev) {
+
+	struct device_list * device_ptr;
+
+	if ( dev->detected_device ) {
+		for ( device_ptr = image->devices; device_ptr; device_ptr = device_ptr->next )
+			if ( device_ptr->device == dev->detected_device || device_ptr->device == DEVICE_ANY )
+				break;
+		if ( ! device_ptr )
+			return 0;
+	}
+
+	return image_hwrev_is_valid(image, dev->detected_hwrev);
+
+}
+
+static int multi_cold_flash(struct multi_port * port, struct device_info * dev) {
+
+	struct multi * multi = port->multi;
+	struct image * x2nd;
+	struct image * secondary;
+	int ret = -1;
+
+	/* Clones share loaded data and crc of images, but every worker has its own read position */
+	x2nd = image_alloc_clone(multi->x2nd);
+	secondary = image_alloc_clone(multi->secondary);
+
+	if ( x2nd && secondary ) {
+		multi_status(port, "Cold flashing");
+		ret = dev_cold_flash_images(dev, x2nd, secondary);
+	}
+
+	image_free(x2nd);
+	image_free(secondary);
+
+	if ( ret == 0 ) {
+		port->cold_flashed = 1;
+		/* Device boots to NOLO, continue with flashing */
+		if ( port->next < multi->count )
+			ret = -EAGAIN;
+	}
+
+	return ret;
+
+}
+
+static int multi_flash_images(struct multi_port * port, struct device_info * dev) {
+
+	struct multi * multi = port->multi;
+	struct image * image;
+	int ret = 0;
+
+	for ( ; port->next < multi->count; ++port->next ) {
+
+		if ( ! multi_image_is_valid(multi->images[port->next], dev) )
+			continue;
+
+		multi_status(port, "Flashing %s", image_type_to_string(multi->images[port->next]->type));
+
+		image = image_alloc_clone(multi->images[port->next]);
+		if ( ! image )
+			return -1;
+
+		ret = dev_flash_image(dev, image);
+		image_free(image);
+
+		if ( ret < 0 )
+			return ret;
+
+	}
+
+	if ( multi->reboot ) {
+		multi_status(port, "Rebooting");
+		dev_reboot_device(dev);
+	}
+
+	return 0;
+
+}
+
+static void * multi_worker(void * arg) {
+
+	struct multi_port * port = arg;
+	struct device_info * dev;
+	int ret = -1;
+
+	printf_progress_set_hook(multi_progress, port);
+
+	multi_status(port, "Initializing");
+
+	/* dev_open_usb() closes usb device on failure */
+	dev = dev_open_usb(port->usb);
+	port->usb = NULL;
+
+	if ( dev ) {
+		if ( port->multi->x2nd && ! port->cold_flashed )
+			ret = multi_cold_flash(port, dev);
+		else
+			ret = multi_flash_images(port, dev);
+		dev_free(dev);
+	}
+
+	printf_progress_set_hook(NULL, NULL);
+
+	pthread_mutex_lock(&port->multi->mutex);
+
+	if ( ret == -EAGAIN ) {
+		port->state = MULTI_WAITING;
+		snprintf(port->status, sizeof(port->status), "Waiting for reconnect");
+	} else if ( ret == 0 ) {
+		port->state = MULTI_DONE;
+		snprintf(port->status, sizeof(port->status), "Done");
+	} else {
+		port->state = MULTI_FAILED;
+	}
+
+	port->percent = -1;
+	port->finished = 1;
+
+	pthread_mutex_unlock(&port->multi->mutex);
+
+	return NULL;
+
+}
+
+static struct multi_port * multi_port_find(struct multi * multi, const char * path) {
+
+	int i;
+
+	for ( i = 0; i < multi->ports_count; ++i )
+		if ( strcmp(multi->ports[i].path, path) == 0 )
+			return &multi->ports[i];
+
+	return NULL;
+
+}
+
+static void multi_port_start(struct multi * multi, struct multi_port * port, struct usb_device * dev) {
+
+	if ( ++port->connects > MULTI_CONNECT_MAX ) {
+		multi_status(port, "Too many reconnects");
+		pthread_mutex_lock(&multi->mutex);
+		port->state = MULTI_FAILED;
+		pthread_mutex_unlock(&multi->mutex);
+		return;
+	}
+
+	PRINTF_END();
+
+	port->usb = usb_device_is_valid(dev);
+	if ( ! port->usb )
+		return;
+
+	pthread_mutex_lock(&multi->mutex);
+	port->state = MULTI_RUNNING;
+	port->finished = 0;
+	pthread_mutex_unlock(&multi->mutex);
+
+	if ( pthread_create(&port->thread, NULL, multi_worker, port) != 0 ) {
+		ERROR("Cannot create thread for device %s", port->path);
+		usb_close_device(port->usb);
+		port->usb = NULL;
+		multi_status(port, "Cannot create thread");
+		pthread_mutex_lock(&multi->mutex);
+		port->state = MULTI_FAILED;
+		pthread_mutex_unlock(&multi->mutex);
+		return;
+	}
+
+	port->running = 1;
+
+}
+
+static void multi_scan(struct multi * multi, int count) {
+
+	struct usb_bus * bus;
+	struct usb_device * dev;
+	struct multi_port * port;
+	char path[sizeof(multi->ports[0].path)];
+	enum multi_state state;
+
+	usb_find_devices();
+
+	for ( bus = usb_get_busses(); bus; bus = bus->next ) {
+
+		for ( dev = bus->devices; dev; dev = dev->next ) {
+
+			if ( ! usb_device_is_supported(dev) )
+				continue;
+
+			if ( usbfs_port_path(bus->dirname, dev->filename, path, sizeof(path)) < 0 )
+				continue;
+
+			port = multi_port_find(multi, path);
+
+			if ( ! port ) {
+				if ( multi->ports_count >= count )
+					continue;
+				port = &multi->ports[multi->ports_count++];
+				port->multi = multi;
+				strcpy(port->path, path);
+				port->state = MULTI_WAITING;
+				port->percent = -1;
+			}
+
+			if ( port->running )
+				continue;
+
+			pthread_mutex_lock(&multi->mutex);
+			state = port->state;
+			pthread_mutex_unlock(&multi->mutex);
+
+			if ( state == MULTI_WAITING )
+				multi_port_start(multi, port, dev);
+
+		}
+
+	}
+
+}
+
+static void multi_print_status(struct multi * multi, int count) {
+
+	char buf[1024];
+	size_t len = 0;
+	int i;
+	int ret;
+
+	if ( multi->ports_count < count )
+		len = snprintf(buf, sizeof(buf), "Waiting for %d USB devices", count - multi->ports_count);
+	else
+		buf[0] = 0;
+
+	pthread_mutex_lock(&multi->mutex);
+
+	for ( i = 0; i < multi->ports_count && len < sizeof(buf); ++i ) {
+		struct multi_port * port = &multi->ports[i];
+		if ( port->percent >= 0 )
+			ret = snprintf(buf + len, sizeof(buf) - len, "%s[%s] %s %d%%", len ? " | " : "", port->path, port->status, port->percent);
+		else
+			ret = snprintf(buf + len, sizeof(buf) - len, "%s[%s] %s", len ? " | " : "", port->path, port->status);
+		if ( ret < 0 )
+			break;
+		len += ret;
+	}
+
+	pthread_mutex_unlock(&multi->mutex);
+
+	PRINTF_LINE("%s", buf);
+
+}
+
+int multi_flash(struct image_list * first, struct image * x2nd, struct image * secondary, int count, int reboot) {
+
+	struct multi multi;
+	struct image_list * image_ptr;
+	void (*prev)(int);
+	int sock;
+	int running;
+	int finished;
+	int failed = 0;
+	int i;
+
+	memset(&multi, 0, sizeof(multi));
+
+	if ( count < 1 )
+		ERROR_RETURN("Invalid number of devices", -1);
+
+	if ( usb_init_busses() < 0 )
+		return -1;
+
+	for ( image_ptr = first; image_ptr; image_ptr = image_ptr->next ) {
+		/* MMC images are flashed via Mk II protocol which is not supported */
+		if ( image_ptr->image->type == IMAGE_MMC )
+			ERROR_RETURN("Flashing of mmc image is not supported in parallel mode", -1);
+		++multi.count;
+	}
+
+	/* Images for cold flashing are loaded and their crc is counted only once for all devices */
+	if ( x2nd && secondary ) {
+		if ( ! image_load(x2nd) || ! image_load(secondary) )
+			ERROR_RETURN("Cannot load images for Cold Flashing", -1);
+		x2nd->crc = crc32(0, x2nd->data, x2nd->size);
+		x2nd->crc_valid = 1;
+		secondary->crc = crc32(0, secondary->data, secondary->size);
+		secondary->crc_valid = 1;
+	}
+
+	if ( multi.count ) {
+		multi.images = calloc(multi.count, sizeof(*multi.images));
+		if ( ! multi.images )
+			ALLOC_ERROR_RETURN(-1);
+		for ( i = 0, image_ptr = first; image_ptr; image_ptr = image_ptr->next )
+			multi.images[i++] = image_ptr->image;
+	}
+
+	multi.ports = calloc(count, sizeof(*multi.ports));
+	if ( ! multi.ports ) {
+		free(multi.images);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	multi.x2nd = x2nd;
+	multi.secondary = secondary;
+	multi.reboot = reboot;
+	pthread_mutex_init(&multi.mutex, NULL);
+
+	signal_quit = 0;
+	prev = signal(SIGINT, signal_handler);
+
+	sock = usbfs_uevent_open();
+
+	PRINTF_BACK();
+	printf("\n");
+
+	while ( 1 ) {
+
+		running = 0;
+		finished = 0;
+
+		for ( i = 0; i < multi.ports_count; ++i ) {
+
+			struct multi_port * port = &multi.ports[i];
+			int done;
+
+			pthread_mutex_lock(&multi.mutex);
+			done = port->finished;
+			port->finished = 0;
+			if ( port->state == MULTI_DONE || port->state == MULTI_FAILED )
+				++finished;
+			pthread_mutex_unlock(&multi.mutex);
+
+			if ( done && port->running ) {
+				pthread_join(port->thread, NULL);
+				port->running = 0;
+			}
+
+			if ( port->running )
+				++running;
+
+		}
+
+		if ( finished == count || ( signal_quit && ! running ) )
+			break;
+
+		if ( ! signal_quit )
+			multi_scan(&multi, count);
+
+		multi_print_status(&multi, count);
+
+		usb_wait_for_device_event(sock, 500);
+
+	}
+
+	usbfs_uevent_close(sock);
+
+	if ( prev != SIG_ERR )
+		signal(SIGINT, prev);
+
+	PRINTF_BACK();
+	printf("\nResults:\n");
+
+	for ( i = 0; i < multi.ports_count; ++i ) {
+		struct multi_port * port = &multi.ports[i];
+		if ( port->state == MULTI_DONE ) {
+			printf("  %-16s OK\n", port->path);
+		} else {
+			printf("  %-16s FAILED (%s)\n", port->path, port->status);
+			++failed;
+		}
+	}
+
+	if ( multi.ports_count < count ) {
+		printf("  %d devices were not connected\n", count - multi.ports_count);
+		failed += count - multi.ports_count;
+	}
+
+	pthread_mutex_destroy(&multi.mutex);
+	free(multi.ports);
+	free(multi.images);
+
+	return failed;
+
+}
+
+static void * multi_ident_worker(void * arg) {
+
+	struct multi_ident * ident = arg;
+	struct device_info * dev;
+
+	/* dev_open_usb() closes usb device on failure */
+	dev = dev_open_usb(ident->usb);
+	ident->usb = NULL;
+
+	if ( dev ) {
+		ident->device = dev->detected_device;
+		ident->hwrev = dev->detected_hwrev;
+		dev_get_nolo_ver(dev, ident->nolo_ver, sizeof(ident->nolo_ver));
+		dev_get_kernel_ver(dev, ident->kernel_ver, sizeof(ident->kernel_ver));
+		dev_get_initfs_ver(dev, ident->initfs_ver, sizeof(ident->initfs_ver));
+		dev_get_sw_ver(dev, ident->sw_ver, sizeof(ident->sw_ver));
+		dev_get_content_ver(dev, ident->content_ver, sizeof(ident->content_ver));
+		dev_free(dev);
+		ident->ok = 1;
+	}
+
+	return NULL;
+
+}
+
+/* Print string as one field of tab separated values */
+static void multi_ident_field(const char * str) {
+
+	putchar('\t');
+
+	if ( ! str || ! str[0] ) {
+		putchar('-');
+		return;
+	}
+
+	for ( ; *str; ++str )
+		putchar(( *str == '\t' || *str == '\n' || *str == '\r' ) ? ' ' : *str);
+
+}
+
+int multi_identify(void) {
+
+	struct usb_bus * bus;
+	struct usb_device * dev;
+	struct multi_ident * idents;
+	struct multi_ident * ident;
+	int count = 0;
+	int failed = 0;
+	int i;
+
+	if ( usb_init_busses() < 0 )
+		return -1;
+
+	usb_find_devices();
+
+	for ( bus = usb_get_busses(); bus; bus = bus->next )
+		for ( dev = bus->devices; dev; dev = dev->next )
+			if ( usb_device_is_supported(dev) )
+				++count;
+
+	if ( count == 0 )
+		ERROR_RETURN("No device detected", -1);
+
+	idents = calloc(count, sizeof(*idents));
+	if ( ! idents )
+		ALLOC_ERROR_RETURN(-1);
+
+	i = 0;
+
+	for ( bus = usb_get_busses(); bus && i < count; bus = bus->next ) {
+
+		for ( dev = bus->devices; dev && i < count; dev = dev->next ) {
+
+			if ( ! usb_device_is_supported(dev) )
+				continue;
+
+			ident = &idents[i++];
+
+			if ( usbfs_port_path(bus->dirname, dev->filename, ident->path, sizeof(ident->path)) < 0 )
+				ident->path[0] = 0;
+
+			PRINTF_END();
+
+			ident->usb = usb_device_is_valid(dev);
+			if ( ! ident->usb )
+				continue;
+
+			ident->protocol = usb_flash_protocol_to_string(ident->usb->flash_device->protocol);
+
+			if ( pthread_create(&ident->thread, NULL, multi_ident_worker, ident) != 0 ) {
+				ERROR("Cannot create thread for device %s", ident->path);
+				usb_close_device(ident->usb);
+				ident->usb = NULL;
+				continue;
+			}
+
+			ident->running = 1;
+
+		}
+
+	}
+
+	for ( i = 0; i < count; ++i )
+		if ( idents[i].running )
+			pthread_join(idents[i].thread, NULL);
+
+	PRINTF_END();
+	printf("\nport\tprotocol\tdevice\thwrev\tnolo\tkernel\tinitfs\tsw\tcontent\tstatus\n");
+
+	for ( i = 0; i < count; ++i ) {
+
+		char hwrev[8] = "";
+
+		ident = &idents[i];
+
+		if ( ident->hwrev > 0 )
+			snprintf(hwrev, sizeof(hwrev), "%d", ident->hwrev);
+
+		printf("%s", ident->path[0] ? ident->path : "-");
+		multi_ident_field(ident->protocol);
+		multi_ident_field(device_to_string(ident->device));
+		multi_ident_field(hwrev);
+		multi_ident_field(ident->nolo_ver);
+		multi_ident_field(ident->kernel_ver);
+		multi_ident_field(ident->initfs_ver);
+		multi_ident_field(ident->sw_ver);
+		multi_ident_field(ident->content_ver);
+		multi_ident_field(ident->ok ? "ok" : "failed");
+		printf("\n");
+
+		if ( ! ident->ok )
+			++failed;
+
+	}
+
+	free(idents);
+
+	return failed;
+
+}
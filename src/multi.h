@@ -0,0 +1,39 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef MULTI_H
+#define MULTI_H
+
+#include "image.h"
+
+/*
+ * Wait for count USB devices and flash them in parallel, one worker thread per device.
+ * Images are shared read only by all workers, x2nd and secondary are used for cold flashing
+ * (NULL means no cold flashing), first is list of images for flashing (NULL means no flashing).
+ * Return number of failed devices or -1 on error
+ */
+int multi_flash(struct image_list * first, struct image * x2nd, struct image * secondary, int count, int reboot);
+
+/*
+ * Identify all connected USB devices in parallel and print one line of tab separated values per device.
+ * Return number of failed devices or -1 on error
+ */
+int multi_identify(void);
+
+#endif
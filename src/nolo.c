@@ -20,12 +20,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include "nolo.h"
 #include "image.h"
 #include "global.h"
 #include "printf-utils.h"
+#include "usbfs.h"
+
+/* Interval of CMT status polling in ms */
+#define CMT_POLL_MIN		100
+#define CMT_POLL_MAX		2000
 
 /* Request type */
 #define NOLO_WRITE		64
@@ -110,20 +116,29 @@ static void nolo_error_log(struct usb_device_info * dev, int only_clear) {
 
 }
 
+/* Identify reply is asked only once per connection, all keys are parsed from it */
 static int nolo_identify_string(struct usb_device_info * dev, const char * str, char * out, size_t size) {
 
-	char buf[512];
+	char * buf = dev->identify;
 	char * ptr;
 	int ret;
 
-	memset(buf, 0, sizeof(buf));
+	if ( dev->identify_size <= 0 ) {
 
-	ret = usb_control_msg(dev->udev, NOLO_QUERY, NOLO_IDENTIFY, 0, 0, (char *)buf, sizeof(buf), 2000);
-	if ( ret < 0 )
-		NOLO_ERROR_RETURN("NOLO_IDENTIFY failed", -1);
+		memset(buf, 0, sizeof(dev->identify));
 
-	if ( (size_t)ret > sizeof(buf) )
-		ret = sizeof(buf);
+		ret = usb_control_msg(dev->udev, NOLO_QUERY, NOLO_IDENTIFY, 0, 0, buf, sizeof(dev->identify), 2000);
+		if ( ret < 0 )
+			NOLO_ERROR_RETURN("NOLO_IDENTIFY failed", -1);
+
+		if ( (size_t)ret > sizeof(dev->identify) )
+			ret = sizeof(dev->identify);
+
+		dev->identify_size = ret;
+
+	}
+
+	ret = dev->identify_size;
 
 	ptr = MEMMEM(buf, ret, str, strlen(str));
 	if ( ! ptr )
@@ -242,6 +257,70 @@ enum device nolo_get_device(struct usb_device_info * dev) {
 
 }
 
+/* Send image data after header, return -1 on transfer error which can be retried, -2 on other error */
+static int nolo_send_image_data(struct usb_device_info * dev, struct image * image, size_t chunk) {
+
+	const void * data;
+	struct image_reader * reader;
+	struct usbfs_stream * stream;
+	struct timespec start, end;
+	uint32_t sent;
+	size_t count;
+	int ret = 0;
+
+	printf_progressbar(0, image->size);
+
+	/* Image is read by separate thread while previous chunk is sent */
+	reader = image_reader_start(image, chunk, readahead);
+	if ( ! reader ) {
+		PRINTF_END();
+		return -2;
+	}
+
+	/* Keep more bulk transfers in flight if usbfs can be used */
+	stream = NULL;
+	if ( ! simulate && usbfs > 0 )
+		stream = usbfs_stream_open(dev, USB_WRITE_DATA_EP, usbfs, usb_transfer_timeout(dev, (size_t)usbfs * chunk));
+
+	sent = 0;
+	while ( sent < image->size ) {
+		data = image_reader_next(reader, &count);
+		if ( ! data ) {
+			ret = -2;
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if ( stream ) {
+			if ( usbfs_stream_write(stream, data, count) < 0 ) {
+				ret = -1;
+				break;
+			}
+		} else if ( ! simulate ) {
+			if ( usb_bulk_write(dev->udev, USB_WRITE_DATA_EP, (char *)data, count, usb_transfer_timeout(dev, count)) != (int)count ) {
+				ret = -1;
+				break;
+			}
+		}
+		/* Stream write returns when URBs are submitted, not completed, so only synchronous transfers are measured */
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if ( ! stream && ! simulate )
+			usb_transfer_done(dev, count, ( end.tv_sec - start.tv_sec ) * 1000.0 + ( end.tv_nsec - start.tv_nsec ) / 1000000.0);
+		sent += count;
+		printf_progressbar(sent, image->size);
+	}
+
+	if ( ret < 0 )
+		PRINTF_END();
+
+	image_reader_stop(reader);
+
+	if ( stream && usbfs_stream_close(stream) < 0 && ret == 0 )
+		ret = -1;
+
+	return ret;
+
+}
+
 static int nolo_send_image(struct usb_device_info * dev, struct image * image, int flash) {
 
 	char buf[0x20000];
@@ -250,9 +329,8 @@ static int nolo_send_image(struct usb_device_info * dev, struct image * image, i
 	uint8_t len;
 	uint16_t hash;
 	uint32_t size;
-	uint32_t need;
-	uint32_t sent;
 	int request;
+	int attempt;
 	int ret;
 
 	if ( flash )
@@ -365,37 +443,44 @@ static int nolo_send_image(struct usb_device_info * dev, struct image * image, i
 	else
 		request = NOLO_SEND_IMAGE;
 
-	printf("Sending image header...\n");
+	/* NOLO cannot continue in the middle of image, but new header starts image again without reconnecting */
+	for ( attempt = 0; ; ++attempt ) {
 
-	if ( ! simulate ) {
-		if ( usb_control_msg(dev->udev, NOLO_WRITE, request, 0, 0, buf, ptr-buf, 2000) < 0 )
-			NOLO_ERROR_RETURN("Sending image header failed", -1);
-	}
+		if ( attempt > 0 ) {
+			nolo_error_log(dev, 0);
+			if ( usb_transfer_backoff(attempt) < 0 )
+				ERROR_RETURN("Sending image failed", -1);
+			printf("Retrying (attempt %d of %d)...\n", attempt, USB_RETRY_MAX);
+			usb_clear_halt(dev->udev, USB_WRITE_DATA_EP);
+		}
+
+		printf("Sending image header...\n");
 
-	if ( flash )
-		printf("Sending and flashing image...\n");
-	else
-		printf("Sending image...\n");
-	printf_progressbar(0, image->size);
-	image_seek(image, 0);
-	sent = 0;
-	while ( sent < image->size ) {
-		need = image->size - sent;
-		if ( need > sizeof(buf) )
-			need = sizeof(buf);
-		ret = image_read(image, buf, need);
-		if ( ret == 0 )
-			break;
 		if ( ! simulate ) {
-			if ( usb_bulk_write(dev->udev, USB_WRITE_DATA_EP, buf, ret, 5000) != ret ) {
-				PRINTF_END();
-				NOLO_ERROR_RETURN("Sending image failed", -1);
+			if ( usb_control_msg(dev->udev, NOLO_WRITE, request, 0, 0, buf, ptr-buf, USB_TIMEOUT_MIN) < 0 ) {
+				ERROR("Sending image header failed");
+				continue;
 			}
 		}
-		sent += ret;
-		printf_progressbar(sent, image->size);
+
+		if ( flash )
+			printf("Sending and flashing image...\n");
+		else
+			printf("Sending image...\n");
+
+		ret = nolo_send_image_data(dev, image, sizeof(buf));
+		if ( ret == 0 )
+			break;
+		else if ( ret == -2 )
+			return -1;
+
+		ERROR("Sending image failed");
+
 	}
 
+	if ( image_hash_verify(image) < 0 )
+		ERROR_RETURN("Image is corrupted, not finishing", -1);
+
 	if ( flash ) {
 		printf("Finishing flashing...\n");
 		if ( ! simulate ) {
@@ -427,6 +512,16 @@ int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
 	unsigned long long int part;
 	unsigned long long int total;
 	unsigned long long int last_total;
+	unsigned long long int last_part = 0;
+	unsigned long long int phase_part = 0;
+	unsigned long long int phase_total = 0;
+	char phase[128] = "";
+	double phase_start = 0;
+	double now;
+	double rate = 0;
+	int interval = CMT_POLL_MIN;
+	int eta;
+	struct timespec ts;
 	char buf[128];
 	char * ptr;
 
@@ -526,8 +621,37 @@ int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
 					state = 2;
 				}
 
-				printf_progressbar(part, total);
+				clock_gettime(CLOCK_MONOTONIC, &ts);
+				now = ts.tv_sec + ts.tv_nsec / 1e9;
+
+				/* Rate is counted from start of erase or program phase */
+				if ( strcmp(buf, phase) != 0 || total != phase_total || part < phase_part ) {
+					strcpy(phase, buf);
+					phase_start = now;
+					phase_part = part;
+					phase_total = total;
+					last_part = part;
+					rate = 0;
+				} else if ( part > phase_part && now > phase_start ) {
+					rate = ( part - phase_part ) / ( now - phase_start );
+				}
+
+				/* Poll again after about 1% of progress, back off when there is no progress */
+				if ( part != last_part && rate > 0 )
+					interval = ( total * 10.0 / rate > CMT_POLL_MAX ) ? CMT_POLL_MAX : (int)( total * 10.0 / rate );
+				else if ( part == last_part )
+					interval *= 2;
+
+				if ( interval < CMT_POLL_MIN )
+					interval = CMT_POLL_MIN;
+				else if ( interval > CMT_POLL_MAX )
+					interval = CMT_POLL_MAX;
+
+				eta = ( rate > 0 && part <= total ) ? (int)( ( total - part ) / rate + 0.5 ) : -1;
+
+				printf_progressbar_eta(part, total, rate, eta);
 				last_total = total;
+				last_part = part;
 
 				if ( strcmp(buf, "erase") == 0 && state <= 0 && part == total ) {
 					printf("Done\n");
@@ -541,7 +665,9 @@ int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
 
 			}
 
-			SLEEP(0xc350); // 0.5s
+			ts.tv_sec = interval / 1000;
+			ts.tv_nsec = ( interval % 1000 ) * 1000000L;
+			nanosleep(&ts, NULL);
 
 		}
 
@@ -785,6 +911,7 @@ int nolo_set_hwrev(struct usb_device_info * dev, int16_t hwrev) {
 	memset(buf, 0, sizeof(buf));
 	snprintf(buf, sizeof(buf), "%d", hwrev);
 	printf("Setting HW revision to: %s\n", buf);
+	dev->identify_size = 0;
 	return nolo_set_string(dev, "hw_rev", buf);
 
 }
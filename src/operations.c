@@ -18,6 +18,7 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "global.h"
 #include "device.h"
@@ -30,18 +31,104 @@
 
 #include "operations.h"
 
-struct device_info * dev_detect(void) {
+/* Device properties are fetched only once and cached until they are changed */
+static void dev_prop_invalidate(struct device_info * dev) {
+
+	int i;
+
+	for ( i = 0; i < DEV_PROP_COUNT; ++i )
+		dev->props[i].valid = 0;
+
+}
+
+static int dev_prop_get_string(struct device_info * dev, enum device_prop_type type, int (*fetch)(struct device_info * dev, char * str, size_t size), char * str, size_t size) {
+
+	struct device_prop * prop = &dev->props[type];
+
+	if ( ! prop->valid ) {
+		prop->str[0] = 0;
+		prop->ret = fetch(dev, prop->str, sizeof(prop->str));
+		prop->str[sizeof(prop->str)-1] = 0;
+		prop->valid = 1;
+	}
+
+	if ( prop->ret < 0 )
+		return prop->ret;
+
+	if ( size == 0 )
+		return 0;
+
+	strncpy(str, prop->str, size-1);
+	str[size-1] = 0;
+	return strlen(str);
+
+}
+
+struct device_info * dev_open_usb(struct usb_device_info * usb) {
 
 	int ret = 0;
 	struct device_info * dev = NULL;
-	struct usb_device_info * usb = NULL;
 
 	dev = calloc(1, sizeof(struct device_info));
-	if ( ! dev )
+	if ( ! dev ) {
+		ALLOC_ERROR();
 		goto clean;
+	}
+
+	dev->method = METHOD_USB;
+	dev->usb = usb;
+
+	if ( dev->usb->flash_device->protocol == FLASH_NOLO )
+		ret = nolo_init(dev->usb);
+	else if ( dev->usb->flash_device->protocol == FLASH_COLD )
+		ret = init_cold_flash(dev->usb);
+	else if ( dev->usb->flash_device->protocol == FLASH_MKII )
+		ret = mkii_init(dev->usb);
+	else if ( dev->usb->flash_device->protocol == FLASH_DISK )
+		ret = disk_init(dev->usb);
+	else {
+		ERROR("Unknown USB mode");
+		goto clean;
+	}
+
+	if ( ret < 0 )
+		goto clean;
+
+	/* NOLO init already asked for device and HW revision, device is parsed from cached identify reply */
+	if ( dev->usb->flash_device->protocol == FLASH_NOLO ) {
+		dev->props[DEV_PROP_DEVICE].ret = nolo_get_device(dev->usb);
+		dev->props[DEV_PROP_DEVICE].valid = 1;
+		dev->props[DEV_PROP_HWREV].ret = dev->usb->hwrev;
+		dev->props[DEV_PROP_HWREV].valid = 1;
+	}
+
+	dev->detected_device = dev_get_device(dev);
+	dev->detected_hwrev = dev_get_hwrev(dev);
+
+	if ( dev->detected_device && dev->usb->device && dev->detected_device != dev->usb->device ) {
+		ERROR("Bad device, expected %s, got %s", device_to_string(dev->usb->device), device_to_string(dev->detected_device));
+		goto clean;
+	}
+
+	return dev;
+
+clean:
+	usb_close_device(usb);
+	free(dev);
+	return NULL;
+
+}
+
+struct device_info * dev_detect(void) {
+
+	struct device_info * dev = NULL;
+	struct usb_device_info * usb = NULL;
 
 	/* LOCAL */
 	if ( local_init() == 0 ) {
+		dev = calloc(1, sizeof(struct device_info));
+		if ( ! dev )
+			return NULL;
 		dev->method = METHOD_LOCAL;
 		dev->detected_device = local_get_device();
 		dev->detected_hwrev = local_get_hwrev();
@@ -50,41 +137,9 @@ struct device_info * dev_detect(void) {
 
 	/* USB */
 	usb = usb_open_and_wait_for_device();
-	if ( usb ) {
-		dev->method = METHOD_USB;
-		dev->usb = usb;
-
-		if ( dev->usb->flash_device->protocol == FLASH_NOLO )
-			ret = nolo_init(dev->usb);
-		else if ( dev->usb->flash_device->protocol == FLASH_COLD )
-			ret = init_cold_flash(dev->usb);
-		else if ( dev->usb->flash_device->protocol == FLASH_MKII )
-			ret = mkii_init(dev->usb);
-		else if ( dev->usb->flash_device->protocol == FLASH_DISK )
-			ret = disk_init(dev->usb);
-		else {
-			ERROR("Unknown USB mode");
-			goto clean;
-		}
-
-		if ( ret < 0 )
-			goto clean;
-
-		dev->detected_device = dev_get_device(dev);
-		dev->detected_hwrev = dev_get_hwrev(dev);
-
-		if ( dev->detected_device && dev->usb->device && dev->detected_device != dev->usb->device ) {
-			ERROR("Bad device, expected %s, got %s", device_to_string(dev->usb->device), device_to_string(dev->detected_device));
-			goto clean;
-		}
-
-		return dev;
-	}
-
-clean:
 	if ( usb )
-		usb_close_device(usb);
-	free(dev);
+		return dev_open_usb(usb);
+
 	return NULL;
 
 }
@@ -100,7 +155,7 @@ void dev_free(struct device_info * dev) {
 
 }
 
-enum device dev_get_device(struct device_info * dev) {
+static enum device dev_fetch_device(struct device_info * dev) {
 
 	if ( dev->method == METHOD_LOCAL )
 		return local_get_device();
@@ -124,8 +179,23 @@ enum device dev_get_device(struct device_info * dev) {
 
 }
 
+enum device dev_get_device(struct device_info * dev) {
+
+	struct device_prop * prop = &dev->props[DEV_PROP_DEVICE];
+
+	if ( ! prop->valid ) {
+		prop->ret = dev_fetch_device(dev);
+		prop->valid = 1;
+	}
+
+	return prop->ret;
+
+}
+
 int dev_load_image(struct device_info * dev, struct image * image) {
 
+	dev_prop_invalidate(dev);
+
 	if ( dev->method == METHOD_LOCAL ) {
 		ERROR("Loading image on local device is not supported");
 		return -1;
@@ -149,6 +219,8 @@ int dev_load_image(struct device_info * dev, struct image * image) {
 
 int dev_cold_flash_images(struct device_info * dev, struct image * x2nd, struct image * secondary) {
 
+	dev_prop_invalidate(dev);
+
 	if ( dev->method == METHOD_LOCAL ) {
 		ERROR("Cold Flashing on local device is not supported");
 		return -1;
@@ -172,6 +244,8 @@ int dev_cold_flash_images(struct device_info * dev, struct image * x2nd, struct
 
 int dev_flash_image(struct device_info * dev, struct image * image) {
 
+	dev_prop_invalidate(dev);
+
 	if ( dev->method == METHOD_LOCAL )
 		return local_flash_image(image);
 
@@ -198,6 +272,185 @@ int dev_flash_image(struct device_info * dev, struct image * image) {
 
 }
 
+/* Rough estimates for flash plan, real values depend on device and host */
+#define PLAN_RATE		0x300000
+#define PLAN_SWITCH_TIME	30
+
+enum plan_phase {
+	PLAN_CURRENT = 0,
+	PLAN_NOLO,
+	PLAN_MKII,
+	PLAN_COUNT,
+};
+
+/* Same decision as dev_flash_image() does without switching mode */
+static int dev_can_flash_image(struct device_info * dev, enum usb_flash_protocol protocol, struct image * image) {
+
+	if ( dev->method == METHOD_LOCAL )
+		return 1;
+
+	if ( protocol == FLASH_NOLO )
+		return image->type != IMAGE_MMC;
+	else if ( protocol == FLASH_MKII )
+		return ( dev->usb->data & (1UL << image->type) ) ? 1 : 0;
+
+	return 0;
+
+}
+
+static enum plan_phase dev_plan_image_phase(struct device_info * dev, enum usb_flash_protocol protocol, struct image * image) {
+
+	if ( dev_can_flash_image(dev, protocol, image) )
+		return PLAN_CURRENT;
+
+	/* Only NOLO cannot flash mmc images, those are flashed in Mk II update mode */
+	if ( image->type != IMAGE_MMC )
+		return PLAN_NOLO;
+
+	return PLAN_MKII;
+
+}
+
+/* X-Loader and secondary must stay together and in original order, so they use phase of the later one */
+static enum plan_phase dev_plan_phase(struct device_info * dev, enum usb_flash_protocol protocol, struct image_list * image_first, struct image * image) {
+
+	enum plan_phase phase = dev_plan_image_phase(dev, protocol, image);
+	enum plan_phase phase_ptr;
+	struct image_list * image_ptr;
+
+	if ( image->type != IMAGE_XLOADER && image->type != IMAGE_SECONDARY )
+		return phase;
+
+	for ( image_ptr = image_first; image_ptr; image_ptr = image_ptr->next ) {
+		if ( image_ptr->image->type != IMAGE_XLOADER && image_ptr->image->type != IMAGE_SECONDARY )
+			continue;
+		phase_ptr = dev_plan_image_phase(dev, protocol, image_ptr->image);
+		if ( phase_ptr > phase )
+			phase = phase_ptr;
+	}
+
+	return phase;
+
+}
+
+int dev_flash_plan(struct device_info * dev, struct image_list ** image_first, struct image * x2nd, struct image * secondary) {
+
+	enum usb_flash_protocol protocol = FLASH_UNKN;
+	const char * names[PLAN_COUNT];
+	struct image_list ** list = NULL;
+	struct image_list * images = image_first ? *image_first : NULL;
+	struct image_list * image_ptr;
+	unsigned long long size;
+	unsigned long long total = 0;
+	int switches = 0;
+	int count = 0;
+	int step = 0;
+	int first;
+	int phase;
+	int i;
+
+	if ( dev->method == METHOD_USB )
+		protocol = dev->usb->flash_device->protocol;
+
+	/* Device boots to NOLO after cold flashing */
+	if ( x2nd && secondary )
+		protocol = FLASH_NOLO;
+
+	names[PLAN_CURRENT] = ( dev->method == METHOD_LOCAL ) ? "Local" : usb_flash_protocol_to_string(protocol);
+	names[PLAN_NOLO] = usb_flash_protocol_to_string(FLASH_NOLO);
+	names[PLAN_MKII] = usb_flash_protocol_to_string(FLASH_MKII);
+
+	for ( image_ptr = images; image_ptr; image_ptr = image_ptr->next )
+		++count;
+
+	if ( count > 0 ) {
+		list = calloc(count, sizeof(*list));
+		if ( ! list )
+			ALLOC_ERROR_RETURN(-1);
+	}
+
+	printf("Flash plan:\n");
+
+	if ( x2nd && secondary ) {
+		if ( dev->method != METHOD_USB || dev->usb->flash_device->protocol != FLASH_COLD )
+			++switches;
+		size = (unsigned long long)x2nd->size + secondary->size;
+		total += size;
+		printf("  %d. %s%s: 2nd, secondary\n", ++step, usb_flash_protocol_to_string(FLASH_COLD), switches ? " (after mode switch)" : "");
+	}
+
+	/* Images which can be flashed in current mode are first, then NOLO and Mk II, order of images in every phase is kept */
+	count = 0;
+	for ( phase = 0; phase < PLAN_COUNT; ++phase ) {
+
+		first = 1;
+		size = 0;
+
+		for ( image_ptr = images; image_ptr && list; image_ptr = image_ptr->next ) {
+
+			if ( (int)dev_plan_phase(dev, protocol, images, image_ptr->image) != phase )
+				continue;
+
+			/* Device is already in that mode, so image cannot be flashed at all */
+			if ( ( phase == PLAN_NOLO && protocol == FLASH_NOLO ) || ( phase == PLAN_MKII && protocol == FLASH_MKII ) )
+				continue;
+
+			if ( first ) {
+				if ( phase != PLAN_CURRENT )
+					++switches;
+				printf("  %d. %s%s: ", ++step, names[phase], phase != PLAN_CURRENT ? " (after mode switch)" : "");
+			}
+
+			printf("%s%s", first ? "" : ", ", image_type_to_string(image_ptr->image->type));
+			first = 0;
+
+			size += image_ptr->image->size;
+			list[count++] = image_ptr;
+
+		}
+
+		if ( ! first )
+			printf("\n");
+
+		total += size;
+
+	}
+
+	/* Images which cannot be flashed in any mode (e.g. mmc when Mk II does not support it) are last */
+	first = 1;
+	for ( image_ptr = images; image_ptr && list; image_ptr = image_ptr->next ) {
+		for ( i = 0; i < count; ++i )
+			if ( list[i] == image_ptr )
+				break;
+		if ( i != count )
+			continue;
+		if ( first )
+			printf("  %d. Unsupported: ", ++step);
+		printf("%s%s", first ? "" : ", ", image_type_to_string(image_ptr->image->type));
+		first = 0;
+		list[count++] = image_ptr;
+	}
+
+	if ( ! first )
+		printf("\n");
+
+	/* Relink list in planned order */
+	for ( i = 0; i < count; ++i ) {
+		list[i]->prev = ( i > 0 ) ? list[i-1] : NULL;
+		list[i]->next = ( i < count-1 ) ? list[i+1] : NULL;
+	}
+
+	if ( count > 0 )
+		*image_first = list[0];
+
+	free(list);
+
+	printf("Estimated time: %llu s (%d mode switches)\n", total / PLAN_RATE + switches * PLAN_SWITCH_TIME, switches);
+
+	return switches;
+
+}
+
 int dev_dump_image(struct device_info * dev, enum image_type image, const char * file) {
 
 	if ( dev->method == METHOD_LOCAL )
@@ -235,6 +488,8 @@ int dev_check_badblocks(struct device_info * dev, const char * device) {
 
 int dev_boot_device(struct device_info * dev, const char * cmdline) {
 
+	dev_prop_invalidate(dev);
+
 	if ( dev->method == METHOD_LOCAL ) {
 		ERROR("Booting device on local device does not make sense");
 		return -1;
@@ -260,6 +515,8 @@ int dev_boot_device(struct device_info * dev, const char * cmdline) {
 
 int dev_reboot_device(struct device_info * dev) {
 
+	dev_prop_invalidate(dev);
+
 	if ( dev->method == METHOD_LOCAL )
 		return local_reboot_device();
 
@@ -284,7 +541,7 @@ int dev_reboot_device(struct device_info * dev) {
 
 }
 
-int dev_get_root_device(struct device_info * dev) {
+static int dev_fetch_root_device(struct device_info * dev) {
 
 	if ( dev->method == METHOD_LOCAL )
 		return local_get_root_device();
@@ -302,8 +559,23 @@ int dev_get_root_device(struct device_info * dev) {
 
 }
 
+int dev_get_root_device(struct device_info * dev) {
+
+	struct device_prop * prop = &dev->props[DEV_PROP_ROOT_DEVICE];
+
+	if ( ! prop->valid ) {
+		prop->ret = dev_fetch_root_device(dev);
+		prop->valid = 1;
+	}
+
+	return prop->ret;
+
+}
+
 int dev_set_root_device(struct device_info * dev, int device) {
 
+	dev->props[DEV_PROP_ROOT_DEVICE].valid = 0;
+
 	if ( dev->method == METHOD_LOCAL )
 		return local_set_root_device(device);
 
@@ -323,7 +595,7 @@ int dev_set_root_device(struct device_info * dev, int device) {
 
 }
 
-int dev_get_usb_host_mode(struct device_info * dev) {
+static int dev_fetch_usb_host_mode(struct device_info * dev) {
 
 	if ( dev->method == METHOD_LOCAL )
 		return local_get_usb_host_mode();
@@ -341,8 +613,23 @@ int dev_get_usb_host_mode(struct device_info * dev) {
 
 }
 
+int dev_get_usb_host_mode(struct device_info * dev) {
+
+	struct device_prop * prop = &dev->props[DEV_PROP_USB_HOST_MODE];
+
+	if ( ! prop->valid ) {
+		prop->ret = dev_fetch_usb_host_mode(dev);
+		prop->valid = 1;
+	}
+
+	return prop->ret;
+
+}
+
 int dev_set_usb_host_mode(struct device_info * dev, int enable) {
 
+	dev->props[DEV_PROP_USB_HOST_MODE].valid = 0;
+
 	if ( dev->method == METHOD_LOCAL )
 		return local_set_usb_host_mode(enable);
 
@@ -362,7 +649,7 @@ int dev_set_usb_host_mode(struct device_info * dev, int enable) {
 
 }
 
-int dev_get_rd_mode(struct device_info * dev) {
+static int dev_fetch_rd_mode(struct device_info * dev) {
 
 	if ( dev->method == METHOD_LOCAL )
 		return local_get_rd_mode();
@@ -380,8 +667,23 @@ int dev_get_rd_mode(struct device_info * dev) {
 
 }
 
+int dev_get_rd_mode(struct device_info * dev) {
+
+	struct device_prop * prop = &dev->props[DEV_PROP_RD_MODE];
+
+	if ( ! prop->valid ) {
+		prop->ret = dev_fetch_rd_mode(dev);
+		prop->valid = 1;
+	}
+
+	return prop->ret;
+
+}
+
 int dev_set_rd_mode(struct device_info * dev, int enable) {
 
+	dev->props[DEV_PROP_RD_MODE].valid = 0;
+
 	if ( dev->method == METHOD_LOCAL )
 		return local_set_rd_mode(enable);
 
@@ -401,7 +703,7 @@ int dev_set_rd_mode(struct device_info * dev, int enable) {
 
 }
 
-int dev_get_rd_flags(struct device_info * dev, char * flags, size_t size) {
+static int dev_fetch_rd_flags(struct device_info * dev, char * flags, size_t size) {
 
 	if ( dev->method == METHOD_LOCAL )
 		return local_get_rd_flags(flags, size);
@@ -419,8 +721,16 @@ int dev_get_rd_flags(struct device_info * dev, char * flags, size_t size) {
 
 }
 
+int dev_get_rd_flags(struct device_info * dev, char * flags, size_t size) {
+
+	return dev_prop_get_string(dev, DEV_PROP_RD_FLAGS, dev_fetch_rd_flags, flags, size);
+
+}
+
 int dev_set_rd_flags(struct device_info * dev, const char * flags) {
 
+	dev->props[DEV_PROP_RD_FLAGS].valid = 0;
+
 	if ( dev->method == METHOD_LOCAL )
 		return local_set_rd_flags(flags);
 
@@ -440,7 +750,7 @@ int dev_set_rd_flags(struct device_info * dev, const char * flags) {
 
 }
 
-int16_t dev_get_hwrev(struct device_info * dev) {
+static int16_t dev_fetch_hwrev(struct device_info * dev) {
 
 	if ( dev->method == METHOD_LOCAL )
 		return local_get_hwrev();
@@ -460,8 +770,23 @@ int16_t dev_get_hwrev(struct device_info * dev) {
 
 }
 
+int16_t dev_get_hwrev(struct device_info * dev) {
+
+	struct device_prop * prop = &dev->props[DEV_PROP_HWREV];
+
+	if ( ! prop->valid ) {
+		prop->ret = dev_fetch_hwrev(dev);
+		prop->valid = 1;
+	}
+
+	return prop->ret;
+
+}
+
 int dev_set_hwrev(struct device_info * dev, int16_t hwrev) {
 
+	dev->props[DEV_PROP_HWREV].valid = 0;
+
 	if ( dev->method == METHOD_LOCAL )
 		return local_set_hwrev(hwrev);
 
@@ -481,7 +806,7 @@ int dev_set_hwrev(struct device_info * dev, int16_t hwrev) {
 
 }
 
-int dev_get_kernel_ver(struct device_info * dev, char * ver, size_t size) {
+static int dev_fetch_kernel_ver(struct device_info * dev, char * ver, size_t size) {
 
 	if ( dev->method == METHOD_LOCAL )
 		return local_get_kernel_ver(ver, size);
@@ -499,8 +824,16 @@ int dev_get_kernel_ver(struct device_info * dev, char * ver, size_t size) {
 
 }
 
+int dev_get_kernel_ver(struct device_info * dev, char * ver, size_t size) {
+
+	return dev_prop_get_string(dev, DEV_PROP_KERNEL_VER, dev_fetch_kernel_ver, ver, size);
+
+}
+
 int dev_set_kernel_ver(struct device_info * dev, const char * ver) {
 
+	dev->props[DEV_PROP_KERNEL_VER].valid = 0;
+
 	if ( dev->method == METHOD_LOCAL )
 		return local_set_kernel_ver(ver);
 
@@ -520,7 +853,7 @@ int dev_set_kernel_ver(struct device_info * dev, const char * ver) {
 
 }
 
-int dev_get_initfs_ver(struct device_info * dev, char * ver, size_t size) {
+static int dev_fetch_initfs_ver(struct device_info * dev, char * ver, size_t size) {
 
 	if ( dev->method == METHOD_LOCAL )
 		return local_get_initfs_ver(ver, size);
@@ -538,8 +871,16 @@ int dev_get_initfs_ver(struct device_info * dev, char * ver, size_t size) {
 
 }
 
+int dev_get_initfs_ver(struct device_info * dev, char * ver, size_t size) {
+
+	return dev_prop_get_string(dev, DEV_PROP_INITFS_VER, dev_fetch_initfs_ver, ver, size);
+
+}
+
 int dev_set_initfs_ver(struct device_info * dev, const char * ver) {
 
+	dev->props[DEV_PROP_INITFS_VER].valid = 0;
+
 	if ( dev->method == METHOD_LOCAL )
 		return local_set_initfs_ver(ver);
 
@@ -559,7 +900,7 @@ int dev_set_initfs_ver(struct device_info * dev, const char * ver) {
 
 }
 
-int dev_get_nolo_ver(struct device_info * dev, char * ver, size_t size) {
+static int dev_fetch_nolo_ver(struct device_info * dev, char * ver, size_t size) {
 
 	if ( dev->method == METHOD_LOCAL )
 		return local_get_nolo_ver(ver, size);
@@ -577,8 +918,16 @@ int dev_get_nolo_ver(struct device_info * dev, char * ver, size_t size) {
 
 }
 
+int dev_get_nolo_ver(struct device_info * dev, char * ver, size_t size) {
+
+	return dev_prop_get_string(dev, DEV_PROP_NOLO_VER, dev_fetch_nolo_ver, ver, size);
+
+}
+
 int dev_set_nolo_ver(struct device_info * dev, const char * ver) {
 
+	dev->props[DEV_PROP_NOLO_VER].valid = 0;
+
 	if ( dev->method == METHOD_LOCAL )
 		return local_set_nolo_ver(ver);
 
@@ -598,7 +947,7 @@ int dev_set_nolo_ver(struct device_info * dev, const char * ver) {
 
 }
 
-int dev_get_sw_ver(struct device_info * dev, char * ver, size_t size) {
+static int dev_fetch_sw_ver(struct device_info * dev, char * ver, size_t size) {
 
 	if ( dev->method == METHOD_LOCAL )
 		return local_get_sw_ver(ver, size);
@@ -618,8 +967,16 @@ int dev_get_sw_ver(struct device_info * dev, char * ver, size_t size) {
 
 }
 
+int dev_get_sw_ver(struct device_info * dev, char * ver, size_t size) {
+
+	return dev_prop_get_string(dev, DEV_PROP_SW_VER, dev_fetch_sw_ver, ver, size);
+
+}
+
 int dev_set_sw_ver(struct device_info * dev, const char * ver) {
 
+	dev->props[DEV_PROP_SW_VER].valid = 0;
+
 	if ( dev->method == METHOD_LOCAL )
 		return local_set_sw_ver(ver);
 
@@ -639,7 +996,7 @@ int dev_set_sw_ver(struct device_info * dev, const char * ver) {
 
 }
 
-int dev_get_content_ver(struct device_info * dev, char * ver, size_t size) {
+static int dev_fetch_content_ver(struct device_info * dev, char * ver, size_t size) {
 
 	if ( dev->method == METHOD_LOCAL )
 		return local_get_content_ver(ver, size);
@@ -657,8 +1014,16 @@ int dev_get_content_ver(struct device_info * dev, char * ver, size_t size) {
 
 }
 
+int dev_get_content_ver(struct device_info * dev, char * ver, size_t size) {
+
+	return dev_prop_get_string(dev, DEV_PROP_CONTENT_VER, dev_fetch_content_ver, ver, size);
+
+}
+
 int dev_set_content_ver(struct device_info * dev, const char * ver) {
 
+	dev->props[DEV_PROP_CONTENT_VER].valid = 0;
+
 	if ( dev->method == METHOD_LOCAL )
 		return local_set_content_ver(ver);
 
@@ -29,14 +29,38 @@ enum connection_method {
 	METHOD_LOCAL,
 };
 
+enum device_prop_type {
+	DEV_PROP_DEVICE = 0,
+	DEV_PROP_HWREV,
+	DEV_PROP_ROOT_DEVICE,
+	DEV_PROP_USB_HOST_MODE,
+	DEV_PROP_RD_MODE,
+	DEV_PROP_RD_FLAGS,
+	DEV_PROP_KERNEL_VER,
+	DEV_PROP_INITFS_VER,
+	DEV_PROP_NOLO_VER,
+	DEV_PROP_SW_VER,
+	DEV_PROP_CONTENT_VER,
+	DEV_PROP_COUNT,
+};
+
+/* Cached return value of dev_get_* function */
+struct device_prop {
+	int valid;
+	int ret;
+	char str[256];
+};
+
 struct device_info {
 	enum connection_method method;
 	enum device detected_device;
 	int16_t detected_hwrev;
 	struct usb_device_info * usb;
+	struct device_prop props[DEV_PROP_COUNT];
 };
 
 struct device_info * dev_detect(void);
+struct device_info * dev_open_usb(struct usb_device_info * usb);
 void dev_free(struct device_info * dev);
 
 enum device dev_get_device(struct device_info * dev);
@@ -44,6 +68,15 @@ enum device dev_get_device(struct device_info * dev);
 int dev_cold_flash_images(struct device_info * dev, struct image * x2nd, struct image * secondary);
 int dev_load_image(struct device_info * dev, struct image * image);
 int dev_flash_image(struct device_info * dev, struct image * image);
+
+/*
+ * Reorder images so that images flashable in current mode are flashed first,
+ * then images which need NOLO and then images which need Mk II update mode.
+ * Print plan and rough time estimate. x2nd and secondary are for cold flashing
+ * (NULL means no cold flashing), image_first can be NULL. Return number of planned mode switches or -1 on error
+ */
+int dev_flash_plan(struct device_info * dev, struct image_list ** image_first, struct image * x2nd, struct image * secondary);
+
 int dev_dump_image(struct device_info * dev, enum image_type image, const char * file);
 int dev_check_badblocks(struct device_info * dev, const char * device);
 
@@ -19,8 +19,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <sys/select.h>
 #include <sys/time.h>
@@ -30,14 +32,79 @@
 
 #include "printf-utils.h"
 
-int printf_prev = 0;
+struct printf_progress_hook {
+	void (*hook)(unsigned long long part, unsigned long long total, void * data);
+	void * data;
+};
 
-void printf_progressbar(unsigned long long part, unsigned long long total) {
+static pthread_key_t hook_key;
+static pthread_key_t prev_key;
+static pthread_once_t hook_once = PTHREAD_ONCE_INIT;
+
+/* Used only when per-thread length cannot be allocated */
+static int prev_fallback;
+
+static void printf_hook_key_create(void) {
+
+	pthread_key_create(&hook_key, free);
+	pthread_key_create(&prev_key, free);
+
+}
+
+int * printf_prev_location(void) {
+
+	int * prev;
+
+	pthread_once(&hook_once, printf_hook_key_create);
+
+	prev = pthread_getspecific(prev_key);
+	if ( ! prev ) {
+		prev = calloc(1, sizeof(*prev));
+		if ( ! prev )
+			return &prev_fallback;
+		pthread_setspecific(prev_key, prev);
+	}
+
+	return prev;
+
+}
+
+void printf_progress_set_hook(void (*hook)(unsigned long long part, unsigned long long total, void * data), void * data) {
+
+	struct printf_progress_hook * old;
+	struct printf_progress_hook * new = NULL;
+
+	pthread_once(&hook_once, printf_hook_key_create);
+
+	if ( hook ) {
+		new = malloc(sizeof(*new));
+		if ( ! new )
+			return;
+		new->hook = hook;
+		new->data = data;
+	}
+
+	old = pthread_getspecific(hook_key);
+	pthread_setspecific(hook_key, new);
+	free(old);
+
+}
+
+static void printf_progressbar_suffix(unsigned long long part, unsigned long long total, const char * suffix) {
 
 	char *columns = getenv("COLUMNS");
+	struct printf_progress_hook * hook;
 	int pc;
 	int tmp, cols = 80;
 
+	pthread_once(&hook_once, printf_hook_key_create);
+
+	hook = pthread_getspecific(hook_key);
+	if ( hook ) {
+		hook->hook(part, total, hook->data);
+		return;
+	}
+
 	/* percentage calculation */
 	pc = total == 0 ? 100 : (int)(part*100/total);
 	( pc < 0 ) ? pc = 0 : ( pc > 100 ) ? pc = 100 : 0;
@@ -49,14 +116,39 @@ void printf_progressbar(unsigned long long part, unsigned long long total) {
 	if ( cols > 115 )
 		cols = 115;
 	cols-=15;
+	if ( suffix )
+		cols -= strlen(suffix);
+	if ( cols < 10 )
+		cols = 10;
 	for ( tmp = cols*pc/100; tmp; tmp-- ) PRINTF_ADD("#");
 	for ( tmp = cols-(cols*pc/100); tmp; tmp-- ) PRINTF_ADD("-");
 	PRINTF_ADD("]");
+	if ( suffix )
+		PRINTF_ADD("%s", suffix);
 	if ( part == total ) PRINTF_END();
 	fflush(stdout);
 
 }
 
+void printf_progressbar(unsigned long long part, unsigned long long total) {
+
+	printf_progressbar_suffix(part, total, NULL);
+
+}
+
+void printf_progressbar_eta(unsigned long long part, unsigned long long total, double rate, int eta) {
+
+	char suffix[64];
+
+	if ( eta < 0 || part == total )
+		suffix[0] = 0;
+	else
+		snprintf(suffix, sizeof(suffix), " %.0f/s ETA %d:%02d", rate, eta / 60, eta % 60);
+
+	printf_progressbar_suffix(part, total, suffix);
+
+}
+
 void printf_and_wait(const char * format, ...) {
 
 	va_list ap;
@@ -22,7 +22,9 @@
 
 #include "global.h"
 
-extern int printf_prev;
+/* Length of current line printed by PRINTF_ADD, every thread (e.g. parallel flashing worker) has its own */
+int * printf_prev_location(void);
+#define printf_prev (*printf_prev_location())
 
 #define PRINTF_BACK() do { if ( printf_prev ) { printf("\r%-*s\r", printf_prev, ""); printf_prev = 0; } } while (0)
 #define PRINTF_ADD(...) do { printf_prev += printf(__VA_ARGS__); } while (0)
@@ -32,6 +34,10 @@ extern int printf_prev;
 #define PRINTF_ERROR_RETURN(str, ...) do { PRINTF_ERROR("%s", str); return __VA_ARGS__; } while (0)
 
 void printf_progressbar(unsigned long long part, unsigned long long total);
+/* Progressbar with rate (units of part per second) and estimated remaining time in seconds, negative eta is not shown */
+void printf_progressbar_eta(unsigned long long part, unsigned long long total, double rate, int eta);
+/* Report progress of calling thread to hook instead of drawing progressbar, NULL hook restores progressbar */
+void printf_progress_set_hook(void (*hook)(unsigned long long part, unsigned long long total, void * data), void * data);
 void printf_and_wait(const char * format, ...);
 
 #endif
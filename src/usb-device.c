@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <ctype.h>
 #include <signal.h>
+#include <time.h>
 #include <dlfcn.h>
 
 #include "global.h"
@@ -38,6 +39,7 @@
 #include "nolo.h"
 #include "cold-flash.h"
 #include "mkii.h"
+#include "usbfs.h"
 
 #ifdef __linux__
 #ifdef LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
@@ -111,7 +113,7 @@ static void usb_reattach_kernel_driver(usb_dev_handle * udev, int interface) {
 
 }
 
-static void usb_descriptor_info_print(usb_dev_handle * udev, struct usb_device * dev, char * product, size_t size) {
+static void usb_descriptor_info_print(usb_dev_handle * udev, struct usb_device * dev, char * product, size_t size, char * serial, size_t serial_size) {
 
 	char buf[1024];
 	char buf2[1024];
@@ -132,6 +134,8 @@ static void usb_descriptor_info_print(usb_dev_handle * udev, struct usb_device *
 	ret = usb_get_string_simple(udev, dev->descriptor.iSerialNumber, buf, sizeof(buf));
 	if ( ! isalnum(buf[0]) )
 		buf[0] = 0;
+	if ( serial )
+		snprintf(serial, serial_size, "%s", buf);
 	for ( i = 0; i < ret; i+=2 ) {
 		sscanf(buf+i, "%2x", &x);
 		if ( x > 32 && x < 128 )
@@ -148,10 +152,11 @@ static void usb_descriptor_info_print(usb_dev_handle * udev, struct usb_device *
 
 }
 
-static struct usb_device_info * usb_device_is_valid(struct usb_device * dev) {
+struct usb_device_info * usb_device_is_valid(struct usb_device * dev) {
 
 	int i;
 	char product[1024];
+	char serial[256];
 	struct usb_device_info * ret = NULL;
 
 	for ( i = 0; usb_devices[i].vendor; ++i ) {
@@ -172,7 +177,7 @@ static struct usb_device_info * usb_device_is_valid(struct usb_device * dev) {
 				return NULL;
 			}
 
-			usb_descriptor_info_print(udev, dev, product, sizeof(product));
+			usb_descriptor_info_print(udev, dev, product, sizeof(product), serial, sizeof(serial));
 
 			if ( usb_devices[i].interface >= 0 ) {
 
@@ -274,6 +279,9 @@ static struct usb_device_info * usb_device_is_valid(struct usb_device * dev) {
 			ret->hwrev = -1;
 			ret->flash_device = &usb_devices[i];
 			ret->udev = udev;
+			if ( usbfs_port_path(dev->bus->dirname, dev->filename, ret->port, sizeof(ret->port)) < 0 )
+				ret->port[0] = 0;
+			snprintf(ret->serial, sizeof(ret->serial), "%s", serial);
 			break;
 		}
 	}
@@ -282,6 +290,176 @@ static struct usb_device_info * usb_device_is_valid(struct usb_device * dev) {
 
 }
 
+int usb_device_is_supported(struct usb_device * dev) {
+
+	int i;
+
+	for ( i = 0; usb_devices[i].vendor; ++i )
+		if ( dev->descriptor.idVendor == usb_devices[i].vendor && dev->descriptor.idProduct == usb_devices[i].product )
+			return 1;
+
+	return 0;
+
+}
+
+int usb_wait_for_device_event(int sock, int timeout) {
+
+	return usbfs_uevent_wait(sock, usb_devices, timeout);
+
+}
+
+/* Device finished in repeat mode, it is skipped until other device is connected to its port */
+struct usb_finished {
+	char port[64]; /* empty if port cannot be identified, then device is recognized only by serial number */
+	char serial[256]; /* empty if not known */
+	int empty; /* no supported device was connected to port since device was finished */
+};
+
+#define USB_FINISHED_MAX 32
+
+static struct usb_finished usb_finished[USB_FINISHED_MAX];
+static int usb_finished_count;
+
+/* Fallback bus/dev path changes when device reconnects, so it does not identify port */
+static int usb_port_is_known(const char * port) {
+
+	return port[0] && ! strchr(port, '/');
+
+}
+
+/* Read serial number string of device which is not opened */
+static void usb_device_serial(struct usb_device * dev, char * serial, size_t size) {
+
+	usb_dev_handle * udev;
+
+	memset(serial, 0, size);
+
+	udev = usb_open(dev);
+	if ( ! udev )
+		return;
+
+	usb_get_string_simple(udev, dev->descriptor.iSerialNumber, serial, size);
+	serial[size-1] = 0;
+	if ( ! isalnum(serial[0]) )
+		serial[0] = 0;
+
+	usb_close(udev);
+
+}
+
+void usb_device_finished(struct usb_device_info * dev) {
+
+	struct usb_finished * finished = NULL;
+	const char * port = usb_port_is_known(dev->port) ? dev->port : "";
+	int i;
+
+	for ( i = 0; i < usb_finished_count && port[0]; ++i )
+		if ( strcmp(usb_finished[i].port, port) == 0 )
+			finished = &usb_finished[i];
+
+	if ( ! finished ) {
+		if ( usb_finished_count == USB_FINISHED_MAX ) {
+			memmove(&usb_finished[0], &usb_finished[1], (USB_FINISHED_MAX-1) * sizeof(usb_finished[0]));
+			--usb_finished_count;
+		}
+		finished = &usb_finished[usb_finished_count++];
+	}
+
+	snprintf(finished->port, sizeof(finished->port), "%s", port);
+	snprintf(finished->serial, sizeof(finished->serial), "%s", dev->serial);
+	finished->empty = 0;
+
+}
+
+/* Remember which ports of finished devices are empty now, list of devices must be already updated by usb_find_devices() */
+static void usb_finished_update(void) {
+
+	struct usb_bus * bus;
+	struct usb_device * dev;
+	char path[sizeof(usb_finished[0].port)];
+	int i;
+
+	for ( i = 0; i < usb_finished_count; ++i ) {
+
+		if ( usb_finished[i].empty )
+			continue;
+
+		usb_finished[i].empty = 1;
+
+		for ( bus = usb_get_busses(); bus && usb_finished[i].empty; bus = bus->next ) {
+			for ( dev = bus->devices; dev; dev = dev->next ) {
+				if ( ! usb_device_is_supported(dev) )
+					continue;
+				if ( ! usb_finished[i].port[0] || ( usbfs_port_path(bus->dirname, dev->filename, path, sizeof(path)) == 0 && strcmp(path, usb_finished[i].port) == 0 ) ) {
+					usb_finished[i].empty = 0;
+					break;
+				}
+			}
+		}
+
+	}
+
+}
+
+/*
+ * Finished device reconnects on its port when it reboots (e.g. to NOLO, PC Suite or Mass Storage mode), so
+ * device on that port is skipped unless its serial number differs. If serial number is not known, device
+ * is accepted only after port was empty, and device without serial number which reconnects first is taken
+ * as the finished one.
+ */
+static int usb_device_is_skipped(struct usb_device * dev) {
+
+	struct usb_finished * finished;
+	char path[sizeof(usb_finished[0].port)];
+	char serial[sizeof(usb_finished[0].serial)];
+	int have_serial = 0;
+	int have_path;
+	int other;
+	int i;
+
+	if ( ! usb_finished_count )
+		return 0;
+
+	have_path = ( usbfs_port_path(dev->bus->dirname, dev->filename, path, sizeof(path)) == 0 );
+
+	for ( i = 0; i < usb_finished_count; ++i ) {
+
+		finished = &usb_finished[i];
+
+		if ( finished->port[0] && ( ! have_path || strcmp(path, finished->port) != 0 ) )
+			continue;
+
+		if ( ! have_serial ) {
+			usb_device_serial(dev, serial, sizeof(serial));
+			have_serial = 1;
+		}
+
+		if ( finished->serial[0] && serial[0] ) {
+			other = ( strcmp(finished->serial, serial) != 0 );
+		} else if ( finished->port[0] && ! finished->serial[0] && serial[0] ) {
+			/* Learn serial number of finished device which was not known in previous mode (e.g. Cold Flash) */
+			snprintf(finished->serial, sizeof(finished->serial), "%s", serial);
+			other = 0;
+		} else {
+			other = finished->empty;
+		}
+
+		if ( ! other )
+			return 1;
+
+		/* Other device replaced finished one on its port */
+		if ( finished->port[0] ) {
+			memmove(finished, finished + 1, (usb_finished_count - i - 1) * sizeof(*finished));
+			--usb_finished_count;
+			--i;
+		}
+
+	}
+
+	return 0;
+
+}
+
 static struct usb_device_info * usb_search_device(struct usb_device * dev, int level) {
 
 	int i;
@@ -290,9 +468,11 @@ static struct usb_device_info * usb_search_device(struct usb_device * dev, int l
 	if ( ! dev )
 		return NULL;
 
-	ret = usb_device_is_valid(dev);
-	if ( ret )
-		return ret;
+	if ( ! usb_device_is_skipped(dev) ) {
+		ret = usb_device_is_valid(dev);
+		if ( ret )
+			return ret;
+	}
 
 	for ( i = 0; i < dev->num_children; i++ ) {
 		ret = usb_search_device(dev->children[i], level + 1);
@@ -313,19 +493,29 @@ static void signal_handler(int signum) {
 
 }
 
+int usb_init_busses(void) {
+
+	if ( dlsym(RTLD_DEFAULT, "libusb_init") )
+		ERROR_RETURN("You are trying to use broken libusb-1.0 library (either directly or via wrapper) which has slow listing of usb devices. It cannot be used for flashing or cold-flashing. Please use libusb 0.1.", -1);
+
+	usb_init();
+	usb_find_busses();
+
+	return 0;
+
+}
+
 struct usb_device_info * usb_open_and_wait_for_device(void) {
 
 	struct usb_bus * bus;
 	struct usb_device_info * ret = NULL;
 	int i = 0;
+	int sock;
 	void (*prev)(int);
 	static char progress[] = {'/','-','\\', '|'};
 
-	if ( dlsym(RTLD_DEFAULT, "libusb_init") )
-		ERROR_RETURN("You are trying to use broken libusb-1.0 library (either directly or via wrapper) which has slow listing of usb devices. It cannot be used for flashing or cold-flashing. Please use libusb 0.1.", NULL);
-
-	usb_init();
-	usb_find_busses();
+	if ( usb_init_busses() < 0 )
+		return NULL;
 
 	PRINTF_BACK();
 	printf("\n");
@@ -334,10 +524,19 @@ struct usb_device_info * usb_open_and_wait_for_device(void) {
 
 	prev = signal(SIGINT, signal_handler);
 
+	/* Kernel uevents wake up waiting loop as soon as device is connected */
+	sock = usbfs_uevent_open();
+
 	while ( ! signal_quit ) {
 
 		PRINTF_LINE("Waiting for USB device... %c", progress[++i%sizeof(progress)]);
 
+		/* Scanning all busses by libusb is slow, check sysfs first */
+		if ( usbfs_find_device(usb_devices) == 0 ) {
+			usbfs_uevent_wait(sock, usb_devices, 500);
+			continue;
+		}
+
 		usb_find_devices();
 
 		for ( bus = usb_get_busses(); bus; bus = bus->next ) {
@@ -361,10 +560,12 @@ struct usb_device_info * usb_open_and_wait_for_device(void) {
 		if ( ret )
 			break;
 
-		SLEEP(0xc350); // 0.5s
+		usbfs_uevent_wait(sock, usb_devices, 500);
 
 	}
 
+	usbfs_uevent_close(sock);
+
 	if ( prev != SIG_ERR )
 		signal(SIGINT, prev);
 
@@ -378,6 +579,72 @@ struct usb_device_info * usb_open_and_wait_for_device(void) {
 
 }
 
+/* Return 1 if supported device which is not skipped is connected */
+static int usb_find_next_device(void) {
+
+	struct usb_bus * bus;
+	struct usb_device * dev;
+
+	usb_find_devices();
+	usb_finished_update();
+
+	for ( bus = usb_get_busses(); bus; bus = bus->next )
+		for ( dev = bus->devices; dev; dev = dev->next )
+			if ( usb_device_is_supported(dev) && ! usb_device_is_skipped(dev) )
+				return 1;
+
+	return 0;
+
+}
+
+int usb_wait_for_next_device(void) {
+
+	int i = 0;
+	int j;
+	int sock;
+	void (*prev)(int);
+	static char progress[] = {'/','-','\\', '|'};
+
+	PRINTF_BACK();
+	printf("\n");
+
+	signal_quit = 0;
+
+	prev = signal(SIGINT, signal_handler);
+
+	sock = usbfs_uevent_open();
+
+	while ( ! signal_quit ) {
+
+		PRINTF_LINE("Waiting for next USB device... %c", progress[++i%sizeof(progress)]);
+
+		/* Without any supported device in sysfs all ports are empty */
+		if ( usbfs_find_device(usb_devices) == 0 ) {
+			for ( j = 0; j < usb_finished_count; ++j )
+				usb_finished[j].empty = 1;
+		} else if ( usb_find_next_device() ) {
+			break;
+		}
+
+		usbfs_uevent_wait(sock, usb_devices, 500);
+
+	}
+
+	usbfs_uevent_close(sock);
+
+	if ( prev != SIG_ERR )
+		signal(SIGINT, prev);
+
+	PRINTF_BACK();
+	printf("\n");
+
+	if ( signal_quit )
+		return -1;
+
+	return 0;
+
+}
+
 void usb_close_device(struct usb_device_info * dev) {
 
 	if ( dev->flash_device->protocol != FLASH_COLD )
@@ -387,6 +654,57 @@ void usb_close_device(struct usb_device_info * dev) {
 
 }
 
+/* Throughput estimate only raises default timeout, allow four times longer transfer than expected from it */
+int usb_transfer_timeout(struct usb_device_info * dev, size_t size) {
+
+	double timeout;
+
+	if ( dev->rate <= 0 )
+		return USB_TIMEOUT_DEFAULT;
+
+	timeout = USB_TIMEOUT_MIN + 4 * size / dev->rate;
+	if ( timeout > USB_TIMEOUT_MAX )
+		timeout = USB_TIMEOUT_MAX;
+
+	return timeout;
+
+}
+
+void usb_transfer_done(struct usb_device_info * dev, size_t size, double ms) {
+
+	double rate;
+
+	if ( ms <= 0 || size == 0 )
+		return;
+
+	rate = size / ms;
+
+	/* Exponential moving average, so one slow transfer does not shorten timeouts too much */
+	if ( dev->rate <= 0 )
+		dev->rate = rate;
+	else
+		dev->rate = ( 7 * dev->rate + rate ) / 8;
+
+}
+
+/* Sleep 250 ms, 500 ms, 1 s, ... before retry attempt, return -1 if there is no more attempt */
+int usb_transfer_backoff(int attempt) {
+
+	struct timespec ts;
+	long ms;
+
+	if ( attempt < 1 || attempt > USB_RETRY_MAX )
+		return -1;
+
+	ms = 250L << ( attempt - 1 );
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = ( ms % 1000 ) * 1000000L;
+	nanosleep(&ts, NULL);
+
+	return 0;
+
+}
+
 void usb_switch_to_nolo(struct usb_device_info * dev) {
 
 	printf("\nSwitching to NOLO mode...\n");
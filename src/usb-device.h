@@ -35,6 +35,12 @@
 
 #include "device.h"
 
+/* Bulk transfer timeouts in ms and number of retries of failed transfer, device can stall for seconds while it erases or writes NAND */
+#define USB_TIMEOUT_DEFAULT	5000
+#define USB_TIMEOUT_MIN		USB_TIMEOUT_DEFAULT
+#define USB_TIMEOUT_MAX		30000
+#define USB_RETRY_MAX		3
+
 enum usb_flash_protocol {
 	FLASH_UNKN = 0,
 	FLASH_NOLO,
@@ -60,12 +66,30 @@ struct usb_device_info {
 	const struct usb_flash_device * flash_device;
 	usb_dev_handle * udev;
 	int data;
+	uint8_t seq; /* number of next Mk II message */
+	double rate; /* measured bulk throughput in bytes per ms, 0 if not known yet */
+	char port[64]; /* sysfs port path of device, see usbfs_port_path */
+	char serial[256]; /* USB serial number string, empty if not known */
+	char identify[512]; /* raw NOLO identify reply, fetched once per connection */
+	int identify_size; /* size of identify reply, 0 if not fetched yet */
 };
 
 const char * usb_flash_protocol_to_string(enum usb_flash_protocol protocol);
+int usb_init_busses(void);
 struct usb_device_info * usb_open_and_wait_for_device(void);
+/* Remember finished device in repeat mode, it is not detected again even when it reboots and reconnects in other mode */
+void usb_device_finished(struct usb_device_info * dev);
+/* Wait until supported device which is not finished is connected. Return -1 if interrupted */
+int usb_wait_for_next_device(void);
+struct usb_device_info * usb_device_is_valid(struct usb_device * dev);
+int usb_device_is_supported(struct usb_device * dev);
+int usb_wait_for_device_event(int sock, int timeout);
 void usb_close_device(struct usb_device_info * dev);
 
+int usb_transfer_timeout(struct usb_device_info * dev, size_t size);
+void usb_transfer_done(struct usb_device_info * dev, size_t size, double ms);
+int usb_transfer_backoff(int attempt);
+
 void usb_switch_to_nolo(struct usb_device_info * dev);
 void usb_switch_to_cold(struct usb_device_info * dev);
 void usb_switch_to_update(struct usb_device_info * dev);
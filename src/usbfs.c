@@ -0,0 +1,637 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Linux specific USB support: sysfs, kernel uevents and usbfs asynchronous bulk transfers */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <poll.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/usbdevice_fs.h>
+#endif
+
+#include "global.h"
+#include "usb-device.h"
+#include "usbfs.h"
+
+#ifdef __linux__
+
+/* Size of one URB, older kernels do not accept bigger bulk URBs */
+#define USBFS_URB_SIZE 0x4000
+
+struct usbfs_stream {
+	struct usb_device_info * dev;
+	int fd;
+	int ep;
+	int timeout;
+	int count;
+	int cur;
+	int pending;
+	int error;
+	size_t fill;
+	struct usbdevfs_urb * urbs;
+	unsigned char * bufs;
+	int * busy;
+};
+
+static int usbfs_read_id(const char * dir, const char * name, const char * format, unsigned int * id) {
+
+	char path[PATH_MAX];
+	FILE * file;
+	int ret;
+
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", dir, name);
+
+	file = fopen(path, "r");
+	if ( ! file )
+		return -1;
+
+	ret = fscanf(file, format, id);
+	fclose(file);
+
+	return ( ret == 1 ) ? 0 : -1;
+
+}
+
+int usbfs_find_device(const struct usb_flash_device * devices) {
+
+	DIR * dir;
+	struct dirent * entry;
+	unsigned int vendor, product;
+	int i;
+	int ret = 0;
+
+	dir = opendir("/sys/bus/usb/devices");
+	if ( ! dir )
+		return -1;
+
+	while ( ! ret && ( entry = readdir(dir) ) ) {
+
+		if ( entry->d_name[0] == '.' )
+			continue;
+
+		if ( usbfs_read_id(entry->d_name, "idVendor", "%x", &vendor) < 0 || usbfs_read_id(entry->d_name, "idProduct", "%x", &product) < 0 )
+			continue;
+
+		for ( i = 0; devices[i].vendor; ++i ) {
+			if ( devices[i].vendor == vendor && devices[i].product == product ) {
+				ret = 1;
+				break;
+			}
+		}
+
+	}
+
+	closedir(dir);
+	return ret;
+
+}
+
+int usbfs_port_path(const char * bus, const char * dev, char * buf, size_t size) {
+
+	DIR * dir;
+	struct dirent * entry;
+	unsigned int busnum, devnum;
+	unsigned int want_busnum = strtoul(bus, NULL, 10);
+	unsigned int want_devnum = strtoul(dev, NULL, 10);
+	int ret = -1;
+
+	dir = opendir("/sys/bus/usb/devices");
+
+	while ( ret < 0 && dir && ( entry = readdir(dir) ) ) {
+
+		/* Skip interfaces and root hubs */
+		if ( entry->d_name[0] == '.' || strchr(entry->d_name, ':') || strncmp(entry->d_name, "usb", 3) == 0 )
+			continue;
+
+		if ( usbfs_read_id(entry->d_name, "busnum", "%u", &busnum) < 0 || usbfs_read_id(entry->d_name, "devnum", "%u", &devnum) < 0 )
+			continue;
+
+		if ( busnum == want_busnum && devnum == want_devnum && snprintf(buf, size, "%s", entry->d_name) < (int)size )
+			ret = 0;
+
+	}
+
+	if ( dir )
+		closedir(dir);
+
+	if ( ret < 0 && snprintf(buf, size, "%s/%s", bus, dev) < (int)size )
+		ret = 0;
+
+	return ret;
+
+}
+
+int usbfs_uevent_open(void) {
+
+	struct sockaddr_nl addr;
+	int sock;
+
+	sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+	if ( sock < 0 )
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1; /* kernel events */
+
+	if ( bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ) {
+		close(sock);
+		return -1;
+	}
+
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	return sock;
+
+}
+
+void usbfs_uevent_close(int sock) {
+
+	if ( sock >= 0 )
+		close(sock);
+
+}
+
+/* Check if uevent message announces new usb device from table */
+static int usbfs_uevent_match(const char * buf, size_t size, const struct usb_flash_device * devices) {
+
+	const char * end = buf + size;
+	unsigned int vendor = 0, product = 0;
+	int action = 0;
+	int subsystem = 0;
+	int devtype = 0;
+	int i;
+
+	for ( ; buf < end; buf += strnlen(buf, end - buf) + 1 ) {
+		if ( strncmp(buf, "ACTION=", 7) == 0 )
+			action = ( strcmp(buf + 7, "add") == 0 || strcmp(buf + 7, "bind") == 0 );
+		else if ( strncmp(buf, "SUBSYSTEM=", 10) == 0 )
+			subsystem = ( strcmp(buf + 10, "usb") == 0 );
+		else if ( strncmp(buf, "DEVTYPE=", 8) == 0 )
+			devtype = ( strcmp(buf + 8, "usb_device") == 0 );
+		else if ( strncmp(buf, "PRODUCT=", 8) == 0 )
+			if ( sscanf(buf + 8, "%x/%x/", &vendor, &product) != 2 )
+				vendor = product = 0;
+	}
+
+	if ( ! action || ! subsystem || ! devtype )
+		return 0;
+
+	for ( i = 0; devices[i].vendor; ++i )
+		if ( devices[i].vendor == vendor && devices[i].product == product )
+			return 1;
+
+	return 0;
+
+}
+
+int usbfs_uevent_wait(int sock, const struct usb_flash_device * devices, int timeout) {
+
+	char buf[8192];
+	struct sockaddr_nl addr;
+	socklen_t addrlen;
+	struct pollfd pfd;
+	struct timespec start, now;
+	ssize_t len;
+	int elapsed;
+	int ret;
+
+	if ( sock < 0 ) {
+		poll(NULL, 0, timeout);
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	elapsed = 0;
+
+	/* Other uevents do not stop waiting */
+	while ( elapsed < timeout ) {
+
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		ret = poll(&pfd, 1, timeout - elapsed);
+		if ( ret == 0 || ( ret < 0 && errno == EINTR ) )
+			return 0;
+		else if ( ret < 0 )
+			return -1;
+
+		while ( 1 ) {
+
+			addrlen = sizeof(addr);
+			len = recvfrom(sock, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&addr, &addrlen);
+			if ( len < 0 )
+				break;
+
+			/* Accept only messages from kernel */
+			if ( addrlen != sizeof(addr) || addr.nl_pid != 0 )
+				continue;
+
+			buf[len] = 0;
+			if ( usbfs_uevent_match(buf, len, devices) )
+				return 1;
+
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = ( now.tv_sec - start.tv_sec ) * 1000 + ( now.tv_nsec - start.tv_nsec ) / 1000000;
+
+	}
+
+	return 0;
+
+}
+
+/* Open own usbfs node of device opened by libusb, its internal file descriptor is not part of libusb API */
+static int usbfs_open(usb_dev_handle * udev) {
+
+	struct usb_device * dev = usb_device(udev);
+	char path[PATH_MAX];
+	int fd;
+
+	if ( ! dev || ! dev->bus )
+		return -1;
+
+	if ( (size_t)snprintf(path, sizeof(path), "/dev/bus/usb/%s/%s", dev->bus->dirname, dev->filename) >= sizeof(path) )
+		return -1;
+
+	fd = open(path, O_RDWR);
+	if ( fd >= 0 || errno != ENOENT )
+		return fd;
+
+	if ( (size_t)snprintf(path, sizeof(path), "/proc/bus/usb/%s/%s", dev->bus->dirname, dev->filename) >= sizeof(path) )
+		return -1;
+
+	return open(path, O_RDWR);
+
+}
+
+/*
+ * Interface can be claimed only by one usbfs file, so libusb handle releases it and usbfs file claims it for
+ * data path. Releasing resets alternate setting, so it is set again after every claim.
+ */
+static int usbfs_claim(int fd, const struct usb_flash_device * flash_device) {
+
+	struct usbdevfs_setinterface setinterface;
+	unsigned int interface;
+
+	if ( flash_device->interface < 0 )
+		return 0;
+
+	interface = flash_device->interface;
+	if ( ioctl(fd, USBDEVFS_CLAIMINTERFACE, &interface) < 0 )
+		return -1;
+
+	if ( flash_device->alternate >= 0 ) {
+		setinterface.interface = flash_device->interface;
+		setinterface.altsetting = flash_device->alternate;
+		if ( ioctl(fd, USBDEVFS_SETINTERFACE, &setinterface) < 0 ) {
+			ioctl(fd, USBDEVFS_RELEASEINTERFACE, &interface);
+			return -1;
+		}
+	}
+
+	return 0;
+
+}
+
+/* Return interface back to libusb handle */
+static int usbfs_release(int fd, struct usb_device_info * dev) {
+
+	unsigned int interface;
+
+	if ( dev->flash_device->interface < 0 )
+		return 0;
+
+	if ( fd >= 0 ) {
+		interface = dev->flash_device->interface;
+		ioctl(fd, USBDEVFS_RELEASEINTERFACE, &interface);
+	}
+
+	if ( usb_claim_interface(dev->udev, dev->flash_device->interface) < 0 ) {
+		ERROR("Cannot claim USB interface back after usbfs transfer");
+		return -1;
+	}
+
+	if ( dev->flash_device->alternate >= 0 && usb_set_altinterface(dev->udev, dev->flash_device->alternate) < 0 ) {
+		ERROR("Cannot set alternate USB interface back after usbfs transfer");
+		return -1;
+	}
+
+	return 0;
+
+}
+
+static void usbfs_discard(struct usbfs_stream * stream) {
+
+	struct usbdevfs_urb * urb;
+	int i;
+
+	for ( i = 0; i < stream->count; ++i )
+		if ( stream->busy[i] )
+			ioctl(stream->fd, USBDEVFS_DISCARDURB, &stream->urbs[i]);
+
+	/* Discarded URBs must be still reaped */
+	while ( stream->pending > 0 && ioctl(stream->fd, USBDEVFS_REAPURB, &urb) == 0 ) {
+		stream->busy[urb - stream->urbs] = 0;
+		--stream->pending;
+	}
+
+}
+
+/* Wait for one finished URB */
+static int usbfs_reap(struct usbfs_stream * stream) {
+
+	struct usbdevfs_urb * urb;
+	struct pollfd pfd;
+	int ret;
+
+	while ( 1 ) {
+
+		ret = ioctl(stream->fd, USBDEVFS_REAPURBNDELAY, &urb);
+		if ( ret == 0 )
+			break;
+
+		if ( errno != EAGAIN ) {
+			ERROR_INFO("Cannot reap URB");
+			stream->error = 1;
+			return -1;
+		}
+
+		pfd.fd = stream->fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+
+		ret = poll(&pfd, 1, stream->timeout);
+		if ( ret == 0 ) {
+			ERROR("Bulk transfer timeout");
+			stream->error = 1;
+			return -1;
+		} else if ( ret < 0 && errno != EINTR ) {
+			ERROR_INFO("Cannot wait for URB");
+			stream->error = 1;
+			return -1;
+		}
+
+	}
+
+	stream->busy[urb - stream->urbs] = 0;
+	--stream->pending;
+
+	if ( urb->status != 0 || urb->actual_length != urb->buffer_length ) {
+		errno = -urb->status;
+		ERROR_INFO("Bulk transfer failed");
+		stream->error = 1;
+		return -1;
+	}
+
+	return 0;
+
+}
+
+static int usbfs_submit(struct usbfs_stream * stream) {
+
+	struct usbdevfs_urb * urb = &stream->urbs[stream->cur];
+
+	memset(urb, 0, sizeof(*urb));
+	urb->type = USBDEVFS_URB_TYPE_BULK;
+	urb->endpoint = stream->ep;
+	urb->buffer = stream->bufs + stream->cur * USBFS_URB_SIZE;
+	urb->buffer_length = stream->fill;
+
+	if ( ioctl(stream->fd, USBDEVFS_SUBMITURB, urb) < 0 ) {
+		ERROR_INFO("Cannot submit URB");
+		stream->error = 1;
+		return -1;
+	}
+
+	stream->busy[stream->cur] = 1;
+	++stream->pending;
+
+	stream->cur = ( stream->cur + 1 ) % stream->count;
+	stream->fill = 0;
+
+	return 0;
+
+}
+
+struct usbfs_stream * usbfs_stream_open(struct usb_device_info * dev, int ep, int urbs, int timeout) {
+
+	struct usbfs_stream * stream;
+	void * bufs;
+	int fd;
+
+	if ( urbs < 1 )
+		return NULL;
+
+	fd = usbfs_open(dev->udev);
+	if ( fd < 0 ) {
+		VERBOSE("Cannot open usbfs node, using libusb\n");
+		return NULL;
+	}
+
+	if ( dev->flash_device->interface >= 0 && usb_release_interface(dev->udev, dev->flash_device->interface) < 0 ) {
+		VERBOSE("Cannot release USB interface, using libusb\n");
+		close(fd);
+		return NULL;
+	}
+
+	if ( usbfs_claim(fd, dev->flash_device) < 0 ) {
+		VERBOSE("Cannot claim USB interface by usbfs, using libusb\n");
+		close(fd);
+		usbfs_release(-1, dev);
+		return NULL;
+	}
+
+	stream = calloc(1, sizeof(struct usbfs_stream));
+	if ( stream ) {
+		stream->urbs = calloc(urbs, sizeof(*stream->urbs));
+		stream->busy = calloc(urbs, sizeof(*stream->busy));
+	}
+
+	if ( ! stream || ! stream->urbs || ! stream->busy || posix_memalign(&bufs, 64, (size_t)urbs * USBFS_URB_SIZE) != 0 ) {
+		if ( stream ) {
+			free(stream->urbs);
+			free(stream->busy);
+			free(stream);
+		}
+		usbfs_release(fd, dev);
+		close(fd);
+		ALLOC_ERROR_RETURN(NULL);
+	}
+
+	stream->dev = dev;
+	stream->bufs = bufs;
+	stream->fd = fd;
+	stream->ep = ep;
+	stream->count = urbs;
+	stream->timeout = timeout;
+
+	return stream;
+
+}
+
+int usbfs_stream_write(struct usbfs_stream * stream, const void * data, size_t size) {
+
+	size_t need;
+
+	while ( size > 0 ) {
+
+		if ( stream->error )
+			return -1;
+
+		/* Wait until buffer for current URB is free */
+		while ( stream->busy[stream->cur] )
+			if ( usbfs_reap(stream) < 0 )
+				return -1;
+
+		need = USBFS_URB_SIZE - stream->fill;
+		if ( need > size )
+			need = size;
+
+		memcpy(stream->bufs + stream->cur * USBFS_URB_SIZE + stream->fill, data, need);
+		stream->fill += need;
+		data = (const unsigned char *)data + need;
+		size -= need;
+
+		if ( stream->fill == USBFS_URB_SIZE && usbfs_submit(stream) < 0 )
+			return -1;
+
+	}
+
+	return 0;
+
+}
+
+int usbfs_stream_close(struct usbfs_stream * stream) {
+
+	int ret;
+
+	if ( ! stream->error && stream->fill > 0 ) {
+		while ( stream->busy[stream->cur] && usbfs_reap(stream) == 0 );
+		if ( ! stream->error )
+			usbfs_submit(stream);
+	}
+
+	while ( ! stream->error && stream->pending > 0 )
+		usbfs_reap(stream);
+
+	if ( stream->error )
+		usbfs_discard(stream);
+
+	ret = stream->error ? -1 : 0;
+
+	if ( usbfs_release(stream->fd, stream->dev) < 0 )
+		ret = -1;
+
+	close(stream->fd);
+
+	free(stream->bufs);
+	free(stream->urbs);
+	free(stream->busy);
+	free(stream);
+
+	return ret;
+
+}
+
+#else
+
+int usbfs_find_device(const struct usb_flash_device * devices) {
+
+	(void)devices;
+	return -1;
+
+}
+
+int usbfs_port_path(const char * bus, const char * dev, char * buf, size_t size) {
+
+	if ( snprintf(buf, size, "%s/%s", bus, dev) >= (int)size )
+		return -1;
+
+	return 0;
+
+}
+
+int usbfs_uevent_open(void) {
+
+	return -1;
+
+}
+
+void usbfs_uevent_close(int sock) {
+
+	(void)sock;
+
+}
+
+int usbfs_uevent_wait(int sock, const struct usb_flash_device * devices, int timeout) {
+
+	(void)sock;
+	(void)devices;
+	poll(NULL, 0, timeout);
+	return 0;
+
+}
+
+struct usbfs_stream * usbfs_stream_open(struct usb_device_info * dev, int ep, int urbs, int timeout) {
+
+	(void)dev;
+	(void)ep;
+	(void)urbs;
+	(void)timeout;
+	return NULL;
+
+}
+
+int usbfs_stream_write(struct usbfs_stream * stream, const void * data, size_t size) {
+
+	(void)stream;
+	(void)data;
+	(void)size;
+	return -1;
+
+}
+
+int usbfs_stream_close(struct usbfs_stream * stream) {
+
+	(void)stream;
+	return -1;
+
+}
+
+#endif
@@ -0,0 +1,53 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef USBFS_H
+#define USBFS_H
+
+#include <stddef.h>
+
+#include "usb-device.h"
+
+struct usbfs_stream;
+
+/* Check sysfs for any device from table (terminated by zero vendor). Return 1 if found, 0 if not, -1 if sysfs is not available */
+int usbfs_find_device(const struct usb_flash_device * devices);
+
+/* Fill buf with sysfs port path (e.g. 1-2.3) of device from libusb bus and device directory names, which stays same after device reconnects. Fallback is bus/dev. Return -1 on error */
+int usbfs_port_path(const char * bus, const char * dev, char * buf, size_t size);
+
+/* Open netlink socket for kernel uevents, return -1 if it is not available */
+int usbfs_uevent_open(void);
+
+/* Close uevent socket */
+void usbfs_uevent_close(int sock);
+
+/* Wait timeout ms for uevent about added device from table (without socket just sleep). Return 1 if device was added, 0 if not, -1 on error */
+int usbfs_uevent_wait(int sock, const struct usb_flash_device * devices, int timeout);
+
+/* Open stream of asynchronous bulk URBs to endpoint ep of opened device by own usbfs node, which claims USB interface until stream is closed. Return NULL if usbfs cannot be used */
+struct usbfs_stream * usbfs_stream_open(struct usb_device_info * dev, int ep, int urbs, int timeout);
+
+/* Queue data to stream, return -1 on error */
+int usbfs_stream_write(struct usbfs_stream * stream, const void * data, size_t size);
+
+/* Send remaining data, wait for all URBs and free stream, return -1 on error */
+int usbfs_stream_close(struct usbfs_stream * stream);
+
+#endif